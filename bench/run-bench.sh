@@ -0,0 +1,39 @@
+#!/bin/sh
+#
+# starts a private daemon and runs the benchmark against it
+#
+# the daemon gets a base directory of its own, so this does not interfere
+# with a running system daemon or other benchmarks; unless run as root,
+# the daemon runs unprivileged
+#
+# usage: run-bench.sh DAEMON BENCH CONFIG [bench options]
+
+DAEMON="$1"
+BENCH="$2"
+CONFIG="$3"
+shift 3
+
+BASE=$(mktemp -d "${TMPDIR:-/tmp}/turnstile-bench.XXXXXX") || exit 1
+SOCKET="$BASE/turnstiled/control.sock"
+
+# every session is a descriptor in the daemon and the benchmark
+ulimit -n "$(ulimit -Hn)"
+
+"$DAEMON" -c "$CONFIG" -o base_path="$BASE" -o state_path="$BASE" &
+DPID=$!
+
+trap 'kill -TERM $DPID 2>/dev/null; wait $DPID; rm -rf "$BASE"' EXIT
+trap 'exit 1' INT TERM
+
+# wait for the control socket to show up
+i=0
+while [ ! -S "$SOCKET" ]; do
+    if ! kill -0 $DPID 2>/dev/null || [ $i -ge 100 ]; then
+        echo "the daemon did not come up" >&2
+        exit 1
+    fi
+    sleep 0.1
+    i=$((i + 1))
+done
+
+"$BENCH" -s "$SOCKET" -p $DPID "$@"
@@ -0,0 +1,622 @@
+/* turnstile-bench: a synthetic login load generator for turnstiled
+ *
+ * it opens sessions the same way pam_turnstile does, many of them at
+ * once over nonblocking sockets, holds them for a while and then closes
+ * them again, reporting how long the daemon took to let them through
+ *
+ * the daemon only accepts sessions from root, or from the user running it
+ * when it is unprivileged, so it is usually run against a test instance
+ *
+ * Copyright 2022 q66 <q66@chimera-linux.org>
+ * License: BSD-2-Clause
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <ctime>
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <pwd.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "protocol.hh"
+
+/* the states a bench session goes through */
+enum {
+    BS_PENDING = 0, /* not connected yet */
+    BS_SEND, /* sending the handshake */
+    BS_WAIT, /* waiting for MSG_OK_DONE */
+    BS_ENV, /* waiting for the environment */
+    BS_HELD, /* fully logged in */
+    BS_CLOSED,
+    BS_FAILED,
+};
+
+/* the orders in which sessions are closed */
+enum {
+    CLOSE_ALL = 0, /* all at once */
+    CLOSE_FIFO, /* oldest first, at the arrival rate */
+    CLOSE_LIFO, /* newest first, at the arrival rate */
+    CLOSE_RANDOM, /* in random order, at the arrival rate */
+};
+
+struct bench_sess {
+    std::string out{};
+    std::size_t out_off = 0;
+    /* incoming data that is not yet complete */
+    unsigned char in[8];
+    std::size_t in_len = 0;
+    /* environment bytes still to be skipped */
+    unsigned int env_left = 0;
+    std::uint64_t t_start = 0;
+    std::uint64_t t_done = 0;
+    unsigned int uid = 0;
+    int fd = -1;
+    int state = BS_PENDING;
+};
+
+struct bench_opts {
+    char const *sock_path = DAEMON_SOCK;
+    std::size_t nsess = 100;
+    std::size_t nuids = 1;
+    double rate = 0;
+    double hold = 1;
+    double timeout = 60;
+    int close_order = CLOSE_ALL;
+    pid_t dpid = -1;
+};
+
+/* daemon resource usage, from procfs */
+struct proc_usage {
+    std::uint64_t cpu_ticks = 0;
+    std::uint64_t rss_kb = 0;
+    std::uint64_t hwm_kb = 0;
+};
+
+static std::uint64_t now_us() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return std::uint64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void usage(FILE *f, char const *progname) {
+    std::fprintf(
+        f, "usage: %s [options]\n\n"
+        "  -n NUM    number of concurrent sessions (default 100)\n"
+        "  -u NUM    spread them over the first NUM users (default 1)\n"
+        "  -r RATE   sessions opened (and closed) per second (default all)\n"
+        "  -t SECS   how long to hold the sessions (default 1)\n"
+        "  -c ORDER  close order: all, fifo, lifo, random (default all)\n"
+        "  -T SECS   give up on sessions after this long (default 60)\n"
+        "  -p PID    report the CPU and memory use of this daemon\n"
+        "  -s PATH   the control socket (default %s)\n"
+        "  -h        print this message\n",
+        progname, DAEMON_SOCK
+    );
+}
+
+static bool proc_read(pid_t pid, proc_usage &pu) {
+    char path[64];
+    char buf[1024];
+    std::snprintf(path, sizeof(path), "/proc/%ld/stat", long(pid));
+    auto *f = std::fopen(path, "r");
+    if (!f) {
+        return false;
+    }
+    auto rlen = std::fread(buf, 1, sizeof(buf) - 1, f);
+    std::fclose(f);
+    buf[rlen] = '\0';
+    /* the command may contain anything, so skip past its end */
+    auto *p = std::strrchr(buf, ')');
+    if (!p) {
+        return false;
+    }
+    unsigned long long utime, stime;
+    /* utime and stime are the 14th and 15th fields */
+    if (std::sscanf(
+        p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+        &utime, &stime
+    ) != 2) {
+        return false;
+    }
+    pu.cpu_ticks = utime + stime;
+    std::snprintf(path, sizeof(path), "/proc/%ld/status", long(pid));
+    f = std::fopen(path, "r");
+    if (!f) {
+        return false;
+    }
+    while (std::fgets(buf, sizeof(buf), f)) {
+        unsigned long long val;
+        if (std::sscanf(buf, "VmRSS: %llu", &val) == 1) {
+            pu.rss_kb = val;
+        } else if (std::sscanf(buf, "VmHWM: %llu", &val) == 1) {
+            pu.hwm_kb = val;
+        }
+    }
+    std::fclose(f);
+    return true;
+}
+
+/* the first nuids users, in the order of the user database */
+static bool get_uids(std::vector<unsigned int> &uids, std::size_t nuids) {
+    setpwent();
+    for (passwd *pwd; (uids.size() < nuids) && (pwd = getpwent());) {
+        uids.push_back(pwd->pw_uid);
+    }
+    endpwent();
+    if (uids.size() < nuids) {
+        std::fprintf(
+            stderr, "only %zu users available, wanted %zu\n",
+            uids.size(), nuids
+        );
+        return false;
+    }
+    return true;
+}
+
+/* the handshake is sent in one go, exactly as pam_turnstile sends it */
+static void sess_prepare(bench_sess &bs, unsigned int uid) {
+    auto put = [&bs](void const *buf, std::size_t len) {
+        bs.out.append(static_cast<char const *>(buf), len);
+    };
+    auto put_str = [&put](char const *str) {
+        std::size_t slen = std::strlen(str);
+        put(&slen, sizeof(slen));
+        put(str, slen);
+    };
+    unsigned char msg = MSG_START;
+    unsigned long vtnr = 0;
+    bool remote = false;
+    bs.uid = uid;
+    put(&msg, sizeof(msg));
+    put(&uid, sizeof(uid));
+    put(&vtnr, sizeof(vtnr));
+    put(&remote, sizeof(remote));
+    put_str("turnstile-bench");
+    put_str("unspecified");
+    put_str("user");
+    /* desktop, seat, tty, display, ruser, rhost */
+    for (int i = 0; i < 6; ++i) {
+        put_str("");
+    }
+}
+
+static bool sess_connect(bench_sess &bs, char const *path) {
+    bs.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (bs.fd < 0) {
+        std::fprintf(stderr, "socket failed (%s)\n", strerror(errno));
+        return false;
+    }
+    sockaddr_un saddr;
+    std::memset(&saddr, 0, sizeof(saddr));
+    saddr.sun_family = AF_UNIX;
+    std::strncpy(saddr.sun_path, path, sizeof(saddr.sun_path) - 1);
+    /* time spent waiting for the backlog counts too */
+    if (!bs.t_start) {
+        bs.t_start = now_us();
+    }
+    if (connect(
+        bs.fd, reinterpret_cast<sockaddr const *>(&saddr), sizeof(saddr)
+    ) < 0) {
+        if ((errno == EAGAIN) || (errno == ECONNREFUSED)) {
+            /* the backlog is full or the daemon is not listening yet */
+            close(bs.fd);
+            bs.fd = -1;
+            return true;
+        }
+        std::fprintf(stderr, "connect failed (%s)\n", strerror(errno));
+        close(bs.fd);
+        bs.fd = -1;
+        return false;
+    }
+    bs.state = BS_SEND;
+    return true;
+}
+
+static void sess_fail(bench_sess &bs) {
+    if (bs.fd >= 0) {
+        close(bs.fd);
+        bs.fd = -1;
+    }
+    bs.state = BS_FAILED;
+}
+
+static void sess_send(bench_sess &bs) {
+    while (bs.out_off < bs.out.size()) {
+        auto ret = send(
+            bs.fd, bs.out.data() + bs.out_off, bs.out.size() - bs.out_off,
+            MSG_NOSIGNAL
+        );
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                sess_fail(bs);
+            }
+            return;
+        }
+        bs.out_off += ret;
+    }
+    bs.out.clear();
+    bs.out_off = 0;
+    if (bs.state == BS_SEND) {
+        bs.state = BS_WAIT;
+    }
+}
+
+/* consume whatever the daemon has sent so far */
+static void sess_recv(bench_sess &bs) {
+    unsigned char buf[512];
+    for (;;) {
+        auto ret = recv(bs.fd, buf, sizeof(buf), 0);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                sess_fail(bs);
+            }
+            return;
+        } else if (ret == 0) {
+            /* the daemon dropped us */
+            sess_fail(bs);
+            return;
+        }
+        for (ssize_t i = 0; i < ret; ++i) {
+            if (bs.env_left) {
+                auto skip = std::min(std::size_t(bs.env_left), size_t(ret - i));
+                bs.env_left -= skip;
+                i += skip - 1;
+                if (!bs.env_left) {
+                    bs.state = BS_HELD;
+                }
+                continue;
+            }
+            bs.in[bs.in_len++] = buf[i];
+            switch (bs.state) {
+                case BS_WAIT:
+                    bs.in_len = 0;
+                    if (buf[i] == MSG_OK_WAIT) {
+                        continue;
+                    } else if (buf[i] != MSG_OK_DONE) {
+                        sess_fail(bs);
+                        return;
+                    }
+                    bs.t_done = now_us();
+                    bs.state = BS_ENV;
+                    bs.out.push_back(char(MSG_REQ_ENV));
+                    sess_send(bs);
+                    if (bs.state == BS_FAILED) {
+                        return;
+                    }
+                    break;
+                case BS_ENV:
+                    if (bs.in[0] != MSG_ENV) {
+                        sess_fail(bs);
+                        return;
+                    }
+                    /* the message followed by the length */
+                    if (bs.in_len < (1 + sizeof(unsigned int))) {
+                        break;
+                    }
+                    std::memcpy(&bs.env_left, &bs.in[1], sizeof(unsigned int));
+                    bs.in_len = 0;
+                    if (!bs.env_left) {
+                        bs.state = BS_HELD;
+                    }
+                    break;
+                default:
+                    /* nothing else is expected */
+                    sess_fail(bs);
+                    return;
+            }
+        }
+    }
+}
+
+static void sess_close(bench_sess &bs) {
+    if (bs.fd >= 0) {
+        close(bs.fd);
+        bs.fd = -1;
+    }
+    if (bs.state != BS_FAILED) {
+        bs.state = BS_CLOSED;
+    }
+}
+
+static std::uint64_t percentile(
+    std::vector<std::uint64_t> const &vals, double q
+) {
+    if (vals.empty()) {
+        return 0;
+    }
+    auto idx = std::size_t(q * double(vals.size()));
+    if (idx >= vals.size()) {
+        idx = vals.size() - 1;
+    }
+    return vals[idx];
+}
+
+static bool parse_num(char const *arg, double &val) {
+    char *endp = nullptr;
+    val = std::strtod(arg, &endp);
+    return (*endp == '\0') && (endp != arg) && (val >= 0);
+}
+
+int main(int argc, char **argv) {
+    bench_opts opts;
+    int c;
+    while ((c = getopt(argc, argv, "n:u:r:t:c:T:p:s:h")) > 0) {
+        double val;
+        switch (c) {
+            case 'n':
+            case 'u':
+            case 'p':
+                if (!parse_num(optarg, val) || (val < 1)) {
+                    std::fprintf(stderr, "invalid value for -%c\n", c);
+                    return 1;
+                }
+                if (c == 'n') {
+                    opts.nsess = std::size_t(val);
+                } else if (c == 'u') {
+                    opts.nuids = std::size_t(val);
+                } else {
+                    opts.dpid = pid_t(val);
+                }
+                break;
+            case 'r':
+            case 't':
+            case 'T':
+                if (!parse_num(optarg, val)) {
+                    std::fprintf(stderr, "invalid value for -%c\n", c);
+                    return 1;
+                }
+                if (c == 'r') {
+                    opts.rate = val;
+                } else if (c == 't') {
+                    opts.hold = val;
+                } else {
+                    opts.timeout = val;
+                }
+                break;
+            case 'c':
+                if (!std::strcmp(optarg, "all")) {
+                    opts.close_order = CLOSE_ALL;
+                } else if (!std::strcmp(optarg, "fifo")) {
+                    opts.close_order = CLOSE_FIFO;
+                } else if (!std::strcmp(optarg, "lifo")) {
+                    opts.close_order = CLOSE_LIFO;
+                } else if (!std::strcmp(optarg, "random")) {
+                    opts.close_order = CLOSE_RANDOM;
+                } else {
+                    std::fprintf(stderr, "invalid close order '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 's':
+                opts.sock_path = optarg;
+                break;
+            case 'h':
+                usage(stdout, argv[0]);
+                return 0;
+            default:
+                usage(stderr, argv[0]);
+                return 1;
+        }
+    }
+    if (optind < argc) {
+        usage(stderr, argv[0]);
+        return 1;
+    }
+
+    /* we need a descriptor for every session */
+    rlimit rl;
+    if (!getrlimit(RLIMIT_NOFILE, &rl) && (rl.rlim_cur < rl.rlim_max)) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    std::vector<unsigned int> uids;
+    if (!get_uids(uids, opts.nuids)) {
+        return 1;
+    }
+
+    std::vector<bench_sess> sess(opts.nsess);
+    for (std::size_t i = 0; i < sess.size(); ++i) {
+        sess_prepare(sess[i], uids[i % uids.size()]);
+    }
+
+    proc_usage pu_start, pu_end;
+    if ((opts.dpid > 0) && !proc_read(opts.dpid, pu_start)) {
+        std::fprintf(stderr, "could not read usage of %ld\n", long(opts.dpid));
+        opts.dpid = -1;
+    }
+
+    /* the interval between arrivals, zero means all at once */
+    std::uint64_t gap = (opts.rate > 0) ? std::uint64_t(1e6 / opts.rate) : 0;
+    std::uint64_t tout = std::uint64_t(opts.timeout * 1e6);
+
+    std::vector<pollfd> pfds;
+    std::vector<std::size_t> pidx;
+    pfds.reserve(sess.size());
+    pidx.reserve(sess.size());
+
+    auto t_begin = now_us();
+    std::size_t next = 0, left = sess.size();
+    while (left) {
+        auto now = now_us();
+        /* start whatever is due */
+        while (next < sess.size()) {
+            auto due = t_begin + next * gap;
+            if (due > now) {
+                break;
+            }
+            auto &bs = sess[next];
+            if (!sess_connect(bs, opts.sock_path)) {
+                return 1;
+            }
+            if (bs.state == BS_PENDING) {
+                if ((now - bs.t_start) <= tout) {
+                    /* backlog full, so retry on the next round */
+                    break;
+                }
+                sess_fail(bs);
+                --left;
+                ++next;
+                continue;
+            }
+            sess_send(bs);
+            ++next;
+        }
+        /* collect what is in flight */
+        now = now_us();
+        pfds.clear();
+        pidx.clear();
+        for (std::size_t i = 0; i < next; ++i) {
+            auto &bs = sess[i];
+            if ((bs.state == BS_HELD) || (bs.state == BS_FAILED)) {
+                continue;
+            }
+            if ((now - bs.t_start) > tout) {
+                sess_fail(bs);
+                --left;
+                continue;
+            }
+            auto &pfd = pfds.emplace_back();
+            pfd.fd = bs.fd;
+            pfd.events = POLLIN;
+            if (!bs.out.empty()) {
+                pfd.events |= POLLOUT;
+            }
+            pfd.revents = 0;
+            pidx.push_back(i);
+        }
+        if (!left) {
+            break;
+        }
+        int ptout = 100;
+        if (next < sess.size()) {
+            auto due = t_begin + next * gap;
+            ptout = (due > now) ? int((due - now + 999) / 1000) : 0;
+            /* retry a full backlog soon */
+            ptout = std::min(ptout, 10);
+        }
+        if (poll(pfds.data(), pfds.size(), ptout) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::fprintf(stderr, "poll failed (%s)\n", strerror(errno));
+            return 1;
+        }
+        for (std::size_t i = 0; i < pfds.size(); ++i) {
+            if (!pfds[i].revents) {
+                continue;
+            }
+            auto &bs = sess[pidx[i]];
+            if (pfds[i].revents & POLLOUT) {
+                sess_send(bs);
+            }
+            if ((bs.state != BS_FAILED) && (pfds[i].revents & (
+                POLLIN | POLLHUP | POLLERR
+            ))) {
+                sess_recv(bs);
+            }
+            if ((bs.state == BS_HELD) || (bs.state == BS_FAILED)) {
+                --left;
+            }
+        }
+    }
+    auto t_open = now_us();
+
+    /* hold everything for a while */
+    if (opts.hold > 0) {
+        timespec ts;
+        ts.tv_sec = time_t(opts.hold);
+        ts.tv_nsec = long((opts.hold - double(ts.tv_sec)) * 1e9);
+        while ((nanosleep(&ts, &ts) < 0) && (errno == EINTR)) {
+            continue;
+        }
+    }
+
+    /* and close it in the requested order */
+    std::vector<std::size_t> order(sess.size());
+    for (std::size_t i = 0; i < order.size(); ++i) {
+        order[i] = i;
+    }
+    if (opts.close_order == CLOSE_LIFO) {
+        std::reverse(order.begin(), order.end());
+    } else if (opts.close_order == CLOSE_RANDOM) {
+        std::shuffle(order.begin(), order.end(), std::mt19937{
+            std::random_device{}()
+        });
+    }
+    auto t_close = now_us();
+    for (std::size_t i = 0; i < order.size(); ++i) {
+        if ((opts.close_order != CLOSE_ALL) && gap) {
+            auto due = t_close + i * gap;
+            auto now = now_us();
+            if (due > now) {
+                usleep(useconds_t(due - now));
+            }
+        }
+        sess_close(sess[order[i]]);
+    }
+    auto t_end = now_us();
+
+    if (opts.dpid > 0) {
+        /* let the daemon catch up with the closed sessions */
+        usleep(200000);
+        proc_read(opts.dpid, pu_end);
+    }
+
+    /* report */
+    std::vector<std::uint64_t> lat;
+    std::size_t nfailed = 0;
+    lat.reserve(sess.size());
+    for (auto &bs: sess) {
+        if (bs.t_done) {
+            lat.push_back(bs.t_done - bs.t_start);
+        } else {
+            ++nfailed;
+        }
+    }
+    std::sort(lat.begin(), lat.end());
+    double open_secs = double(t_open - t_begin) / 1e6;
+    std::printf("sessions: %zu (%zu failed) over %zu users\n",
+        sess.size(), nfailed, uids.size()
+    );
+    std::printf("open: %.3f s, %.1f sessions/s\n",
+        open_secs, (open_secs > 0) ? double(lat.size()) / open_secs : 0.0
+    );
+    std::printf("close: %.3f s\n", double(t_end - t_close) / 1e6);
+    std::printf(
+        "time to MSG_OK_DONE (us): p50 %llu, p90 %llu, p99 %llu, "
+        "p999 %llu, max %llu\n",
+        (unsigned long long)percentile(lat, 0.5),
+        (unsigned long long)percentile(lat, 0.9),
+        (unsigned long long)percentile(lat, 0.99),
+        (unsigned long long)percentile(lat, 0.999),
+        (unsigned long long)(lat.empty() ? 0 : lat.back())
+    );
+    if (opts.dpid > 0) {
+        double ticks = double(sysconf(_SC_CLK_TCK));
+        std::printf(
+            "daemon: cpu %.2f s, rss %llu kB (peak %llu kB)\n",
+            double(pu_end.cpu_ticks - pu_start.cpu_ticks) / ticks,
+            (unsigned long long)pu_end.rss_kb,
+            (unsigned long long)pu_end.hwm_kb
+        );
+    }
+    return nfailed ? 1 : 0;
+}
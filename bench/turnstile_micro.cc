@@ -0,0 +1,473 @@
+/* turnstile-micro: microbenchmarks of the daemon internals
+ *
+ * every case runs one of the functions the daemon calls on the way of a
+ * login in isolation, at a few sizes, and reports the time and the number
+ * of allocations (through operator new) per call; the cases that need
+ * something set up before every call (such as a directory tree to clear)
+ * only count the call itself
+ *
+ * any change to these paths should come with the numbers from before and
+ * after, on the same machine
+ *
+ * Copyright 2022 q66 <q66@chimera-linux.org>
+ * License: BSD-2-Clause
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <ctime>
+#include <deque>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+
+#include "turnstiled.hh"
+
+static std::uint64_t nallocs = 0;
+
+void *operator new(std::size_t sz) {
+    ++nallocs;
+    auto *p = std::malloc(sz ? sz : 1);
+    if (!p) {
+        throw std::bad_alloc{};
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept {
+    std::free(p);
+}
+
+struct micro_opts {
+    double secs = 0.2;
+    char const *filter = nullptr;
+};
+
+static micro_opts opts;
+
+static std::uint64_t now_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return std::uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static void usage(FILE *f, char const *progname) {
+    std::fprintf(
+        f, "usage: %s [options]\n\n"
+        "  -t SECS   roughly how long to run every case (default 0.2)\n"
+        "  -f NAME   only run the cases whose name contains NAME\n"
+        "  -h        print this message\n",
+        progname
+    );
+}
+
+static bool micro_skip(char const *name) {
+    return opts.filter && !std::strstr(name, opts.filter);
+}
+
+static void micro_report(
+    char const *name, std::size_t size, std::uint64_t iters,
+    std::uint64_t ns, std::uint64_t allocs
+) {
+    std::printf(
+        "%-28s %6zu %12.1f ns/op %8.2f allocs/op\n", name, size,
+        double(ns) / double(iters), double(allocs) / double(iters)
+    );
+}
+
+/* runs fn over and over, first to find out how many times fit into the
+ * time given and then for real; prep is run before every call and is not
+ * counted, fn returns false if something went wrong
+ */
+template<typename P, typename F>
+static bool micro_run(char const *name, std::size_t size, P &&prep, F &&fn) {
+    if (micro_skip(name)) {
+        return true;
+    }
+    auto run = [&prep, &fn](
+        std::uint64_t iters, std::uint64_t &ns, std::uint64_t &allocs
+    ) {
+        ns = allocs = 0;
+        for (std::uint64_t i = 0; i < iters; ++i) {
+            prep();
+            auto a = nallocs;
+            auto t = now_ns();
+            bool ok = fn();
+            ns += now_ns() - t;
+            allocs += nallocs - a;
+            if (!ok) {
+                return false;
+            }
+        }
+        return true;
+    };
+    std::uint64_t iters = 1, ns, allocs;
+    auto target = std::uint64_t(opts.secs * 1e9);
+    for (;;) {
+        if (!run(iters, ns, allocs)) {
+            std::fprintf(stderr, "%s failed (%s)\n", name, strerror(errno));
+            return false;
+        }
+        if ((ns >= (target / 10)) || (iters >= (1ULL << 32))) {
+            break;
+        }
+        iters *= 2;
+    }
+    auto niters = std::uint64_t(double(iters) * double(target) / double(ns));
+    if (niters > iters) {
+        iters = niters;
+        if (!run(iters, ns, allocs)) {
+            std::fprintf(stderr, "%s failed (%s)\n", name, strerror(errno));
+            return false;
+        }
+    }
+    micro_report(name, size, iters, ns, allocs);
+    return true;
+}
+
+template<typename F>
+static bool micro_run(char const *name, std::size_t size, F &&fn) {
+    return micro_run(name, size, []() {}, fn);
+}
+
+/* logins with the given number of sessions each, with made up fds */
+static void make_logins(
+    std::deque<login> &logins, std::size_t nlogins, std::size_t nsess
+) {
+    int fd = 0;
+    for (std::size_t i = 0; i < nlogins; ++i) {
+        auto &lgn = logins.emplace_back();
+        lgn.uid = 1000 + i;
+        lgn.gid = 1000 + i;
+        lgn.username = "user" + std::to_string(i);
+        lgn.rundir = "/run/user/" + std::to_string(lgn.uid);
+        lgn.repopulate = false;
+        for (std::size_t j = 0; j < nsess; ++j) {
+            auto &sess = lgn.sessions.emplace_back();
+            sess.fd = fd++;
+            sess.id = fd;
+            sess.lgn = &lgn;
+            sess.vtnr = 0;
+            sess.remote = false;
+            sess.lpid = 1;
+            sess.s_service = "login";
+            sess.s_type = "tty";
+            sess.s_class = "user";
+            sess.s_seat = "seat0";
+            sess.s_tty = "tty1";
+        }
+    }
+}
+
+static bool bench_get_session() {
+    static std::size_t const sizes[][2] = {{1, 1}, {16, 4}, {256, 4}};
+    for (auto &sz: sizes) {
+        std::deque<login> logins;
+        make_logins(logins, sz[0], sz[1]);
+        int nfds = int(sz[0] * sz[1]), fd = 0;
+        /* every session in turn, so this is the average */
+        if (!micro_run("get_session", std::size_t(nfds), [&]() {
+            auto *sess = get_session(logins, fd);
+            fd = (fd + 1) % nfds;
+            return sess != nullptr;
+        })) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool bench_login_populate(std::shared_ptr<cfg_data> const &cfg) {
+    for (std::size_t nlogins: {1, 16, 256}) {
+        std::deque<login> logins;
+        make_logins(logins, nlogins, 1);
+        /* the last one, which is the worst case */
+        auto uid = logins.back().uid;
+        if (!micro_run("login_populate/existing", nlogins, [&]() {
+            return login_populate(logins, cfg, uid) != nullptr;
+        })) {
+            return false;
+        }
+    }
+    /* a new login goes through the user database */
+    std::deque<login> logins;
+    auto uid = getuid();
+    return micro_run("login_populate/lookup", 1, [&]() {
+        auto *lgn = login_populate(logins, cfg, uid);
+        if (lgn) {
+            lgn->repopulate = true;
+        }
+        return lgn != nullptr;
+    });
+}
+
+static bool bench_write_data(int dfd) {
+    if (
+        (mkdirat(dfd, "users", 0755) < 0) ||
+        (mkdirat(dfd, "sessions", 0755) < 0)
+    ) {
+        std::fprintf(stderr, "mkdirat failed (%s)\n", strerror(errno));
+        return false;
+    }
+    int udfd = openat(dfd, "users", O_RDONLY | O_DIRECTORY);
+    int sdfd = openat(dfd, "sessions", O_RDONLY | O_DIRECTORY);
+    if ((udfd < 0) || (sdfd < 0)) {
+        std::fprintf(stderr, "openat failed (%s)\n", strerror(errno));
+        return false;
+    }
+    bool ok = true;
+    for (std::size_t nsess: {1, 16, 128}) {
+        std::deque<login> logins;
+        make_logins(logins, 1, nsess);
+        auto &lgn = logins.back();
+        ok = micro_run("write_udata", nsess, [&]() {
+            return write_udata(lgn, udfd);
+        }) && micro_run("write_sdata", nsess, [&]() {
+            return write_sdata(lgn.sessions.back(), sdfd, udfd);
+        });
+        if (!ok) {
+            break;
+        }
+    }
+    close(udfd);
+    close(sdfd);
+    return ok;
+}
+
+static bool bench_expand_rundir() {
+    static char const *tmpls[] = {
+        "/run/user/%u",
+        "/run/user/%u/%g",
+        "/var/lib/some/longer/location/for/the/runtime/directory/%u",
+    };
+    std::string dest;
+    for (auto *tmpl: tmpls) {
+        if (!micro_run("cfg_expand_rundir", std::strlen(tmpl), [&]() {
+            /* as the daemon does it, on a string that had a rundir before */
+            dest.clear();
+            cfg_expand_rundir(dest, tmpl, 1000, 1000);
+            return true;
+        })) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* a tree of the given depth, with nfiles files and ndirs directories in
+ * every directory; returns the number of entries
+ */
+static std::size_t make_tree(
+    int dfd, std::size_t depth, std::size_t nfiles, std::size_t ndirs
+) {
+    char name[32];
+    std::size_t ret = 0;
+    for (std::size_t i = 0; i < nfiles; ++i) {
+        std::snprintf(name, sizeof(name), "f%zu", i);
+        int fd = openat(dfd, name, O_CREAT | O_WRONLY | O_CLOEXEC, 0644);
+        if (fd >= 0) {
+            close(fd);
+            ++ret;
+        }
+    }
+    if (!depth) {
+        return ret;
+    }
+    for (std::size_t i = 0; i < ndirs; ++i) {
+        std::snprintf(name, sizeof(name), "d%zu", i);
+        if (mkdirat(dfd, name, 0755) < 0) {
+            continue;
+        }
+        int sdfd = openat(dfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (sdfd < 0) {
+            continue;
+        }
+        ret += make_tree(sdfd, depth - 1, nfiles, ndirs) + 1;
+        close(sdfd);
+    }
+    return ret;
+}
+
+static bool bench_dir_clear(int dfd) {
+    static std::size_t const trees[][3] = {
+        /* depth, files, directories */
+        {0, 16, 0}, {0, 256, 0}, {3, 4, 4},
+    };
+    /* the trees are made up front, so do not bother */
+    if (micro_skip("dir_clear_contents")) {
+        return true;
+    }
+    if (mkdirat(dfd, "tree", 0755) < 0) {
+        std::fprintf(stderr, "mkdirat failed (%s)\n", strerror(errno));
+        return false;
+    }
+    for (auto &tr: trees) {
+        int tfd = -1;
+        std::size_t nents = 0;
+        auto prep = [&]() {
+            tfd = openat(dfd, "tree", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (tfd >= 0) {
+                nents = make_tree(tfd, tr[0], tr[1], tr[2]);
+            }
+        };
+        /* the size is only known once there is a tree */
+        prep();
+        auto size = nents;
+        if (!micro_run("dir_clear_contents", size, prep, [&]() {
+            return dir_clear_contents(tfd);
+        })) {
+            return false;
+        }
+    }
+    return !unlinkat(dfd, "tree", AT_REMOVEDIR);
+}
+
+/* the handshake exactly as pam_turnstile sends it */
+static void make_handshake(std::string &out, std::size_t slen) {
+    auto put = [&out](void const *buf, std::size_t len) {
+        out.append(static_cast<char const *>(buf), len);
+    };
+    auto put_str = [&put](std::string const &str) {
+        std::size_t len = str.size();
+        put(&len, sizeof(len));
+        put(str.data(), len);
+    };
+    unsigned char msg = MSG_START;
+    unsigned int uid = 1000;
+    unsigned long vtnr = 1;
+    bool remote = slen > 0;
+    put(&msg, sizeof(msg));
+    put(&uid, sizeof(uid));
+    put(&vtnr, sizeof(vtnr));
+    put(&remote, sizeof(remote));
+    put_str("login");
+    put_str("tty");
+    put_str("user");
+    put_str("");
+    put_str("seat0");
+    put_str("tty1");
+    put_str("");
+    /* the remote user and host are the long ones */
+    put_str(std::string(slen, 'u'));
+    put_str(std::string(slen, 'h'));
+}
+
+static bool bench_handshake() {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) < 0) {
+        std::fprintf(stderr, "socketpair failed (%s)\n", strerror(errno));
+        return false;
+    }
+    bool ok = true;
+    for (std::size_t slen: {0, 64, 256}) {
+        std::string hs;
+        make_handshake(hs, slen);
+        /* like other sessions in the daemon, this keeps the strings from
+         * the previous run in the pool
+         */
+        session prev;
+        auto prep = [&]() {
+            if (send(sv[1], hs.data(), hs.size(), 0) != ssize_t(hs.size())) {
+                std::abort();
+            }
+        };
+        ok = micro_run("handshake", hs.size(), prep, [&]() {
+            /* the start message and the uid come before the session */
+            unsigned char msg;
+            unsigned int uid;
+            if (
+                !recv_val(sv[0], &msg, sizeof(msg)) ||
+                !recv_val(sv[0], &uid, sizeof(uid))
+            ) {
+                return false;
+            }
+            session sess;
+            sess.fd = sv[0];
+            while (sess.pend_rhost) {
+                if (!sess_handshake(sess)) {
+                    return false;
+                }
+            }
+            prev = std::move(sess);
+            return true;
+        });
+        if (!ok) {
+            break;
+        }
+    }
+    close(sv[0]);
+    close(sv[1]);
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    int c;
+    while ((c = getopt(argc, argv, "t:f:h")) > 0) {
+        switch (c) {
+            case 't': {
+                char *endp = nullptr;
+                opts.secs = std::strtod(optarg, &endp);
+                if (*endp || (endp == optarg) || !(opts.secs > 0)) {
+                    std::fprintf(stderr, "invalid value for -t\n");
+                    return 1;
+                }
+                break;
+            }
+            case 'f':
+                opts.filter = optarg;
+                break;
+            case 'h':
+                usage(stdout, argv[0]);
+                return 0;
+            default:
+                usage(stderr, argv[0]);
+                return 1;
+        }
+    }
+    if (optind < argc) {
+        usage(stderr, argv[0]);
+        return 1;
+    }
+
+    /* the defaults, with nothing logged */
+    auto cfg = std::make_shared<cfg_data>();
+    cdata = cfg.get();
+
+    /* the file system cases work in a scratch directory */
+    char const *tmpdir = std::getenv("TMPDIR");
+    std::string scratch = tmpdir ? tmpdir : "/tmp";
+    scratch += "/turnstile-micro.XXXXXX";
+    if (!mkdtemp(scratch.data())) {
+        std::fprintf(stderr, "mkdtemp failed (%s)\n", strerror(errno));
+        return 1;
+    }
+    int dfd = open(scratch.data(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd < 0) {
+        std::fprintf(stderr, "open failed (%s)\n", strerror(errno));
+        rmdir(scratch.data());
+        return 1;
+    }
+
+    std::printf("%-28s %6s %18s %18s\n", "case", "size", "time", "allocs");
+    bool ok = bench_get_session() && bench_login_populate(cfg) &&
+        bench_write_data(dfd) && bench_expand_rundir() &&
+        bench_dir_clear(dfd) && bench_handshake();
+
+    /* this takes the descriptor with it */
+    dir_clear_contents(dfd);
+    rmdir(scratch.data());
+    return ok ? 0 : 1;
+}
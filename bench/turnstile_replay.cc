@@ -0,0 +1,682 @@
+/* turnstile-replay: replays a traffic capture against turnstiled
+ *
+ * the capture is written by the daemon when capture_path is set; every
+ * connection in it that made it through the handshake is opened again at
+ * the same relative time (optionally sped up or slowed down), sends the
+ * same handshake, asks for the environment if the original did and is
+ * closed when the original was, and in the end the latencies the daemon
+ * showed in the capture are compared with those seen now
+ *
+ * the uids in the capture are mapped onto the first users of the user
+ * database, in the order they first appear, so that a capture taken on
+ * one machine (and anonymized) can be replayed on another
+ *
+ * Copyright 2022 q66 <q66@chimera-linux.org>
+ * License: BSD-2-Clause
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <ctime>
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <pwd.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "protocol.hh"
+#include "cap_trace.hh"
+
+/* the states a replayed connection goes through */
+enum {
+    RS_PENDING = 0, /* not connected yet */
+    RS_OPEN, /* connected, the handshake is not due yet */
+    RS_SEND, /* sending the handshake */
+    RS_WAIT, /* waiting for MSG_OK_DONE */
+    RS_ENV, /* waiting for the environment */
+    RS_HELD, /* logged in, waiting to be closed */
+    RS_CLOSED,
+    RS_FAILED,
+};
+
+struct replay_conn {
+    /* from the capture, in microseconds since its start */
+    std::uint64_t c_accept = 0;
+    std::uint64_t c_hshake = 0;
+    std::uint64_t c_done = 0;
+    std::uint64_t c_close = 0;
+    std::uint32_t c_uid = 0;
+    bool c_hshaken = false;
+    bool c_got_done = false;
+    bool c_env = false;
+    /* the replay */
+    std::string out{};
+    std::size_t out_off = 0;
+    unsigned char in[8];
+    std::size_t in_len = 0;
+    unsigned int env_left = 0;
+    std::uint64_t t_hshake = 0;
+    std::uint64_t t_done = 0;
+    int fd = -1;
+    int state = RS_PENDING;
+};
+
+struct replay_opts {
+    char const *sock_path = DAEMON_SOCK;
+    char const *cap_path = nullptr;
+    double speed = 1;
+    double timeout = 60;
+    std::size_t nuids = 0;
+};
+
+static std::uint64_t now_us() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return std::uint64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void usage(FILE *f, char const *progname) {
+    std::fprintf(
+        f, "usage: %s [options] CAPTURE\n\n"
+        "  -x SPEED  replay this many times faster (default 1)\n"
+        "  -u NUM    use at most the first NUM users (default one for\n"
+        "            every user in the capture)\n"
+        "  -T SECS   give up on sessions after this long (default 60)\n"
+        "  -s PATH   the control socket (default %s)\n"
+        "  -h        print this message\n",
+        progname, DAEMON_SOCK
+    );
+}
+
+static bool read_file(char const *path, std::vector<unsigned char> &buf) {
+    auto *f = std::fopen(path, "rb");
+    if (!f) {
+        std::fprintf(stderr, "could not open %s (%s)\n", path, strerror(errno));
+        return false;
+    }
+    unsigned char rbuf[65536];
+    for (;;) {
+        auto rlen = std::fread(rbuf, 1, sizeof(rbuf), f);
+        buf.insert(buf.end(), rbuf, rbuf + rlen);
+        if (rlen < sizeof(rbuf)) {
+            break;
+        }
+    }
+    bool ok = !std::ferror(f);
+    std::fclose(f);
+    if (!ok) {
+        std::fprintf(stderr, "could not read %s\n", path);
+    }
+    return ok;
+}
+
+/* turn a handshake record into what pam_turnstile would send for it */
+static bool conn_prepare(
+    replay_conn &rc, unsigned char const *data, std::size_t len
+) {
+    cap_session cs;
+    if (len < sizeof(cs)) {
+        return false;
+    }
+    std::memcpy(&cs, data, sizeof(cs));
+    rc.c_uid = cs.uid;
+    /* the uid is filled in once it is known */
+    unsigned char msg = MSG_START;
+    unsigned int uid = 0;
+    unsigned long vtnr = cs.vtnr;
+    bool remote = cs.remote;
+    rc.out.push_back(char(msg));
+    rc.out.append(reinterpret_cast<char const *>(&uid), sizeof(uid));
+    rc.out.append(reinterpret_cast<char const *>(&vtnr), sizeof(vtnr));
+    rc.out.append(reinterpret_cast<char const *>(&remote), sizeof(remote));
+    std::size_t off = sizeof(cs);
+    for (int i = 0; i < CAP_STRINGS; ++i) {
+        std::uint16_t slen;
+        if ((off + sizeof(slen)) > len) {
+            return false;
+        }
+        std::memcpy(&slen, &data[off], sizeof(slen));
+        off += sizeof(slen);
+        if ((off + slen) > len) {
+            return false;
+        }
+        std::size_t plen = slen;
+        rc.out.append(reinterpret_cast<char const *>(&plen), sizeof(plen));
+        rc.out.append(reinterpret_cast<char const *>(&data[off]), slen);
+        off += slen;
+    }
+    rc.c_hshaken = true;
+    return true;
+}
+
+/* split the capture into connections, dropping those that never got a
+ * session (failed handshakes and control clients such as turnstiled-events)
+ */
+static bool cap_parse(
+    std::vector<unsigned char> const &buf, std::vector<replay_conn> &conns,
+    std::uint64_t &span, std::size_t &nskipped, bool &anon
+) {
+    cap_header hdr;
+    if (
+        (buf.size() < sizeof(hdr)) ||
+        (std::memcpy(&hdr, buf.data(), sizeof(hdr)), hdr.magic != CAP_MAGIC)
+    ) {
+        std::fprintf(stderr, "not a capture\n");
+        return false;
+    }
+    if (hdr.version != CAP_VERSION) {
+        std::fprintf(stderr, "unsupported capture version %u\n", hdr.version);
+        return false;
+    }
+    anon = hdr.anon;
+    std::unordered_map<std::int32_t, std::size_t> open;
+    std::vector<replay_conn> all;
+    std::uint64_t first = 0, last = 0, shift = 0;
+    std::size_t off = sizeof(hdr);
+    while (off < buf.size()) {
+        cap_entry ent;
+        if ((off + sizeof(ent)) > buf.size()) {
+            std::fprintf(stderr, "truncated capture, ignoring the rest\n");
+            break;
+        }
+        std::memcpy(&ent, &buf[off], sizeof(ent));
+        off += sizeof(ent);
+        if ((off + ent.len) > buf.size()) {
+            std::fprintf(stderr, "truncated capture, ignoring the rest\n");
+            break;
+        }
+        auto *data = &buf[off];
+        off += ent.len;
+        /* a capture may span reboots, so never let the time go back */
+        if (!first) {
+            first = ent.time;
+        } else if ((ent.time + shift) < last) {
+            shift = last - ent.time;
+        }
+        last = ent.time + shift;
+        auto t = (last - first) / 1000;
+        if (ent.code == CAP_ACCEPT) {
+            open[ent.fd] = all.size();
+            all.emplace_back().c_accept = t;
+            continue;
+        }
+        auto it = open.find(ent.fd);
+        if (it == open.end()) {
+            /* connections carried over an upgrade have no start */
+            continue;
+        }
+        auto &rc = all[it->second];
+        switch (ent.code) {
+            case CAP_RECV:
+                if (ent.len && (data[0] == MSG_REQ_ENV)) {
+                    rc.c_env = true;
+                }
+                break;
+            case CAP_HANDSHAKE:
+                rc.c_hshake = t;
+                if (!conn_prepare(rc, data, ent.len)) {
+                    std::fprintf(stderr, "invalid handshake record\n");
+                    return false;
+                }
+                break;
+            case CAP_SEND:
+                if (ent.len && (data[0] == MSG_OK_DONE) && !rc.c_got_done) {
+                    rc.c_done = t;
+                    rc.c_got_done = true;
+                }
+                break;
+            case CAP_CLOSE:
+                rc.c_close = t;
+                open.erase(it);
+                break;
+            default:
+                /* from a newer daemon, so of no interest */
+                break;
+        }
+    }
+    span = (last - first) / 1000;
+    nskipped = 0;
+    for (auto &rc: all) {
+        if (!rc.c_hshaken) {
+            ++nskipped;
+            continue;
+        }
+        /* the daemon may say it is done while the handshake is still
+         * coming in, the client only sees that once it has sent it all
+         */
+        if (rc.c_got_done && (rc.c_done < rc.c_hshake)) {
+            rc.c_done = rc.c_hshake;
+        }
+        /* still open when the capture ended */
+        if (!rc.c_close) {
+            rc.c_close = span;
+        }
+        conns.push_back(std::move(rc));
+    }
+    return true;
+}
+
+/* the first users of the user database, as many as there are */
+static bool get_uids(std::vector<unsigned int> &uids, std::size_t nuids) {
+    setpwent();
+    for (passwd *pwd; (uids.size() < nuids) && (pwd = getpwent());) {
+        uids.push_back(pwd->pw_uid);
+    }
+    endpwent();
+    if (uids.empty()) {
+        std::fprintf(stderr, "no users available\n");
+        return false;
+    } else if (uids.size() < nuids) {
+        std::fprintf(
+            stderr, "only %zu users available for %zu, sharing them\n",
+            uids.size(), nuids
+        );
+    }
+    return true;
+}
+
+static bool conn_connect(replay_conn &rc, char const *path) {
+    rc.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (rc.fd < 0) {
+        std::fprintf(stderr, "socket failed (%s)\n", strerror(errno));
+        return false;
+    }
+    sockaddr_un saddr;
+    std::memset(&saddr, 0, sizeof(saddr));
+    saddr.sun_family = AF_UNIX;
+    std::strncpy(saddr.sun_path, path, sizeof(saddr.sun_path) - 1);
+    if (connect(
+        rc.fd, reinterpret_cast<sockaddr const *>(&saddr), sizeof(saddr)
+    ) < 0) {
+        auto err = errno;
+        close(rc.fd);
+        rc.fd = -1;
+        if ((err == EAGAIN) || (err == ECONNREFUSED)) {
+            /* the backlog is full, try again later */
+            return true;
+        }
+        std::fprintf(stderr, "connect failed (%s)\n", strerror(err));
+        return false;
+    }
+    rc.state = RS_OPEN;
+    return true;
+}
+
+static void conn_fail(replay_conn &rc) {
+    if (rc.fd >= 0) {
+        close(rc.fd);
+        rc.fd = -1;
+    }
+    rc.state = RS_FAILED;
+}
+
+static void conn_send(replay_conn &rc) {
+    while (rc.out_off < rc.out.size()) {
+        auto ret = send(
+            rc.fd, rc.out.data() + rc.out_off, rc.out.size() - rc.out_off,
+            MSG_NOSIGNAL
+        );
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                conn_fail(rc);
+            }
+            return;
+        }
+        rc.out_off += ret;
+    }
+    rc.out.clear();
+    rc.out_off = 0;
+    if (rc.state == RS_SEND) {
+        rc.state = RS_WAIT;
+    }
+}
+
+static void conn_recv(replay_conn &rc) {
+    unsigned char buf[512];
+    for (;;) {
+        auto ret = recv(rc.fd, buf, sizeof(buf), 0);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                conn_fail(rc);
+            }
+            return;
+        } else if (ret == 0) {
+            conn_fail(rc);
+            return;
+        }
+        for (ssize_t i = 0; i < ret; ++i) {
+            if (rc.env_left) {
+                auto skip = std::min(std::size_t(rc.env_left), size_t(ret - i));
+                rc.env_left -= skip;
+                i += skip - 1;
+                if (!rc.env_left) {
+                    rc.state = RS_HELD;
+                }
+                continue;
+            }
+            rc.in[rc.in_len++] = buf[i];
+            switch (rc.state) {
+                case RS_WAIT:
+                    rc.in_len = 0;
+                    if (buf[i] == MSG_OK_WAIT) {
+                        continue;
+                    } else if (buf[i] != MSG_OK_DONE) {
+                        conn_fail(rc);
+                        return;
+                    }
+                    rc.t_done = now_us();
+                    if (!rc.c_env) {
+                        rc.state = RS_HELD;
+                        break;
+                    }
+                    rc.state = RS_ENV;
+                    rc.out.push_back(char(MSG_REQ_ENV));
+                    conn_send(rc);
+                    if (rc.state == RS_FAILED) {
+                        return;
+                    }
+                    break;
+                case RS_ENV:
+                    if (rc.in[0] != MSG_ENV) {
+                        conn_fail(rc);
+                        return;
+                    }
+                    if (rc.in_len < (1 + sizeof(unsigned int))) {
+                        break;
+                    }
+                    std::memcpy(&rc.env_left, &rc.in[1], sizeof(unsigned int));
+                    rc.in_len = 0;
+                    if (!rc.env_left) {
+                        rc.state = RS_HELD;
+                    }
+                    break;
+                default:
+                    conn_fail(rc);
+                    return;
+            }
+        }
+    }
+}
+
+static std::uint64_t percentile(
+    std::vector<std::uint64_t> const &vals, double q
+) {
+    if (vals.empty()) {
+        return 0;
+    }
+    auto idx = std::size_t(q * double(vals.size()));
+    if (idx >= vals.size()) {
+        idx = vals.size() - 1;
+    }
+    return vals[idx];
+}
+
+static bool parse_num(char const *arg, double &val) {
+    char *endp = nullptr;
+    val = std::strtod(arg, &endp);
+    return (*endp == '\0') && (endp != arg) && (val >= 0);
+}
+
+static void print_lat(char const *what, std::vector<std::uint64_t> &lat) {
+    std::sort(lat.begin(), lat.end());
+    std::printf(
+        "%s time to MSG_OK_DONE (us): p50 %llu, p90 %llu, p99 %llu, "
+        "max %llu\n", what,
+        (unsigned long long)percentile(lat, 0.5),
+        (unsigned long long)percentile(lat, 0.9),
+        (unsigned long long)percentile(lat, 0.99),
+        (unsigned long long)(lat.empty() ? 0 : lat.back())
+    );
+}
+
+int main(int argc, char **argv) {
+    replay_opts opts;
+    int c;
+    while ((c = getopt(argc, argv, "x:u:T:s:h")) > 0) {
+        double val;
+        switch (c) {
+            case 'x':
+            case 'T':
+                if (!parse_num(optarg, val) || ((c == 'x') && !(val > 0))) {
+                    std::fprintf(stderr, "invalid value for -%c\n", c);
+                    return 1;
+                }
+                if (c == 'x') {
+                    opts.speed = val;
+                } else {
+                    opts.timeout = val;
+                }
+                break;
+            case 'u':
+                if (!parse_num(optarg, val) || (val < 1)) {
+                    std::fprintf(stderr, "invalid value for -%c\n", c);
+                    return 1;
+                }
+                opts.nuids = std::size_t(val);
+                break;
+            case 's':
+                opts.sock_path = optarg;
+                break;
+            case 'h':
+                usage(stdout, argv[0]);
+                return 0;
+            default:
+                usage(stderr, argv[0]);
+                return 1;
+        }
+    }
+    if ((optind + 1) != argc) {
+        usage(stderr, argv[0]);
+        return 1;
+    }
+    opts.cap_path = argv[optind];
+
+    std::vector<unsigned char> buf;
+    if (!read_file(opts.cap_path, buf)) {
+        return 1;
+    }
+    std::vector<replay_conn> conns;
+    std::uint64_t span;
+    std::size_t nskipped;
+    bool anon;
+    if (!cap_parse(buf, conns, span, nskipped, anon)) {
+        return 1;
+    }
+    buf = std::vector<unsigned char>{};
+    if (conns.empty()) {
+        std::fprintf(stderr, "no sessions in the capture\n");
+        return 1;
+    }
+
+    /* every captured uid gets a user of its own, while there are enough */
+    std::unordered_map<std::uint32_t, std::size_t> uidx;
+    for (auto &rc: conns) {
+        uidx.emplace(rc.c_uid, uidx.size());
+    }
+    std::vector<unsigned int> uids;
+    auto nuids = uidx.size();
+    if (opts.nuids && (opts.nuids < nuids)) {
+        nuids = opts.nuids;
+    }
+    if (!get_uids(uids, nuids)) {
+        return 1;
+    }
+    for (auto &rc: conns) {
+        unsigned int uid = uids[uidx[rc.c_uid] % uids.size()];
+        std::memcpy(&rc.out[1], &uid, sizeof(uid));
+    }
+
+    /* we may need a descriptor for every session */
+    rlimit rl;
+    if (!getrlimit(RLIMIT_NOFILE, &rl) && (rl.rlim_cur < rl.rlim_max)) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    std::uint64_t tout = std::uint64_t(opts.timeout * 1e6);
+    auto t_begin = now_us();
+    /* when something from the capture is due in the replay */
+    auto due = [t_begin, &opts](std::uint64_t t) {
+        return t_begin + std::uint64_t(double(t) / opts.speed);
+    };
+
+    std::vector<std::size_t> active;
+    std::vector<pollfd> pfds;
+    std::vector<std::size_t> pidx;
+    std::size_t next = 0;
+    while ((next < conns.size()) || !active.empty()) {
+        auto now = now_us();
+        /* open whatever is due */
+        while ((next < conns.size()) && (due(conns[next].c_accept) <= now)) {
+            auto &rc = conns[next];
+            if (!conn_connect(rc, opts.sock_path)) {
+                return 1;
+            }
+            if (rc.state == RS_PENDING) {
+                if ((now - due(rc.c_accept)) <= tout) {
+                    break;
+                }
+                conn_fail(rc);
+            } else {
+                active.push_back(next);
+            }
+            ++next;
+        }
+        /* move the open ones along */
+        std::uint64_t wake = ~std::uint64_t(0);
+        if (next < conns.size()) {
+            wake = due(conns[next].c_accept);
+        }
+        pfds.clear();
+        pidx.clear();
+        for (std::size_t i = 0; i < active.size();) {
+            auto &rc = conns[active[i]];
+            if ((rc.state == RS_OPEN) && (due(rc.c_hshake) <= now)) {
+                rc.state = RS_SEND;
+                rc.t_hshake = now;
+                conn_send(rc);
+            }
+            bool waiting = (rc.state >= RS_SEND) && (rc.state < RS_HELD);
+            if (waiting && ((now - rc.t_hshake) > tout)) {
+                conn_fail(rc);
+                waiting = false;
+            }
+            /* a session the original got is not cut short */
+            auto t_close = due(rc.c_close);
+            if (
+                (rc.state == RS_FAILED) ||
+                ((t_close <= now) && !(waiting && rc.c_got_done))
+            ) {
+                if (rc.fd >= 0) {
+                    close(rc.fd);
+                    rc.fd = -1;
+                }
+                if (rc.state != RS_FAILED) {
+                    rc.state = RS_CLOSED;
+                }
+                active[i] = active.back();
+                active.pop_back();
+                continue;
+            }
+            if (rc.state == RS_OPEN) {
+                wake = std::min(wake, due(rc.c_hshake));
+            } else if (!waiting) {
+                wake = std::min(wake, t_close);
+            }
+            auto &pfd = pfds.emplace_back();
+            pfd.fd = rc.fd;
+            pfd.events = POLLIN;
+            /* the handshake waits in the buffer until it is due */
+            if ((rc.state != RS_OPEN) && !rc.out.empty()) {
+                pfd.events |= POLLOUT;
+            }
+            pfd.revents = 0;
+            pidx.push_back(active[i]);
+            ++i;
+        }
+        int ptout = 100;
+        if (wake <= now) {
+            ptout = 0;
+        } else if ((wake - now) < 100000) {
+            ptout = int((wake - now + 999) / 1000);
+        }
+        /* retry a full backlog soon */
+        if ((next < conns.size()) && (conns[next].fd < 0) && !ptout) {
+            ptout = 1;
+        }
+        if (poll(pfds.data(), pfds.size(), ptout) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::fprintf(stderr, "poll failed (%s)\n", strerror(errno));
+            return 1;
+        }
+        for (std::size_t i = 0; i < pfds.size(); ++i) {
+            if (!pfds[i].revents) {
+                continue;
+            }
+            auto &rc = conns[pidx[i]];
+            if (pfds[i].revents & POLLOUT) {
+                conn_send(rc);
+            }
+            if ((rc.state != RS_FAILED) && (pfds[i].revents & (
+                POLLIN | POLLHUP | POLLERR
+            ))) {
+                conn_recv(rc);
+            }
+        }
+    }
+    auto t_end = now_us();
+
+    /* report */
+    std::vector<std::uint64_t> c_lat, r_lat, diff;
+    std::size_t only_c = 0, only_r = 0;
+    for (auto &rc: conns) {
+        if (rc.c_got_done) {
+            c_lat.push_back(rc.c_done - rc.c_hshake);
+        }
+        if (rc.t_done) {
+            r_lat.push_back(rc.t_done - rc.t_hshake);
+        }
+        if (rc.c_got_done && rc.t_done) {
+            auto cl = rc.c_done - rc.c_hshake;
+            auto rl = rc.t_done - rc.t_hshake;
+            diff.push_back((rl > cl) ? (rl - cl) : (cl - rl));
+        } else if (rc.c_got_done) {
+            ++only_c;
+        } else if (rc.t_done) {
+            ++only_r;
+        }
+    }
+    std::printf(
+        "sessions: %zu over %zu users%s (%zu other connections skipped)\n",
+        conns.size(), uidx.size(), anon ? " (anonymized)" : "", nskipped
+    );
+    std::printf(
+        "replay: %.3f s for %.3f s of capture at %gx\n",
+        double(t_end - t_begin) / 1e6, double(span) / 1e6, opts.speed
+    );
+    std::printf(
+        "mismatches: %zu (logged in only originally: %zu, only now: %zu)\n",
+        only_c + only_r, only_c, only_r
+    );
+    print_lat("capture", c_lat);
+    print_lat("replay", r_lat);
+    print_lat("divergence in", diff);
+    return 0;
+}
@@ -0,0 +1,64 @@
+/* the traffic capture format, shared by the daemon and the replay tool
+ *
+ * Copyright 2022 q66 <q66@chimera-linux.org>
+ * License: BSD-2-Clause
+ */
+
+#ifndef TURNSTILED_CAP_TRACE_HH
+#define TURNSTILED_CAP_TRACE_HH
+
+#include <cstdint>
+
+/* what happened on a connection; codes may only ever be appended */
+enum cap_code {
+    CAP_ACCEPT = 0, /* the connection was accepted */
+    CAP_RECV, /* a byte-sized message came in, the data is the message */
+    CAP_HANDSHAKE, /* the session handshake is done, see below */
+    CAP_SEND, /* a byte-sized message went out, the data is the message */
+    CAP_CLOSE, /* the connection was closed */
+    CAP_CODES,
+};
+
+/* the capture is a header followed by the records, in the order they
+ * happened; it is appended to as the daemon goes, so there is no count,
+ * and it is only ever read on the same kind of machine, so it is native
+ */
+#define CAP_MAGIC 0x54534350
+#define CAP_VERSION 1
+
+struct cap_header {
+    std::uint32_t magic;
+    std::uint16_t version;
+    /* whether the uids are anonymized */
+    std::uint16_t anon;
+    /* add to a record's time to get the wall clock time */
+    std::int64_t realtime;
+};
+
+/* every record is followed by len bytes of data */
+struct cap_entry {
+    /* monotonic time in nanoseconds */
+    std::uint64_t time;
+    /* the connection, which is unique until it is closed */
+    std::int32_t fd;
+    std::uint16_t code;
+    std::uint16_t len;
+};
+
+static_assert(sizeof(cap_entry) == 16, "unexpected record size");
+
+/* the data of a handshake is this, followed by the strings the client
+ * sent in protocol order, each as a 16-bit length and the bytes; when
+ * anonymized, the uid is replaced with an unrelated but stable number
+ * and the remote user and host are left empty
+ */
+struct cap_session {
+    std::uint64_t vtnr;
+    std::uint32_t uid;
+    std::uint32_t remote;
+};
+
+/* service, type, class, desktop, seat, tty, display, ruser, rhost */
+#define CAP_STRINGS 9
+
+#endif
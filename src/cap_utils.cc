@@ -0,0 +1,222 @@
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <cerrno>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/random.h>
+
+#include "turnstiled.hh"
+
+/* the capture goes through a large buffer, so that recording is mostly
+ * a copy; it is written out whenever it fills up and when the capture is
+ * closed, which also happens before an upgrade and on exit
+ *
+ * this is not stdio, as forked children would write out their copy of
+ * the buffer when they exit; for the same reason, only the process that
+ * opened the capture ever writes to it
+ */
+static constexpr std::size_t cap_bufsize = 65536;
+
+static unsigned char cap_buf[cap_bufsize];
+static std::size_t cap_used = 0;
+static int cap_fd = -1;
+static pid_t cap_pid = -1;
+static std::string cap_path;
+static bool cap_anon = false;
+/* the key for anonymizing uids, which is never written into the capture */
+static std::uint64_t cap_key = 0;
+static bool cap_have_key = false;
+
+static std::uint64_t cap_time(clockid_t clk) {
+    timespec ts;
+    clock_gettime(clk, &ts);
+    return std::uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+/* a keyed permutation of the uid space, so that every user gets its own
+ * number that cannot be mapped back without the key
+ */
+static std::uint32_t cap_uid(std::uint32_t uid) {
+    std::uint32_t l = uid >> 16, r = uid & 0xFFFF;
+    for (unsigned int i = 0; i < 4; ++i) {
+        std::uint32_t f = (r ^ std::uint32_t(cap_key >> (16 * i))) & 0xFFFF;
+        f *= 0x9E3779B1;
+        f ^= f >> 15;
+        auto nr = l ^ (f & 0xFFFF);
+        l = r;
+        r = nr;
+    }
+    return (l << 16) | r;
+}
+
+/* a capture that already exists is appended to, as long as it is one */
+static bool cap_check(int fd, bool anon, char const *path) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        print_err("capture: fstat failed (%s)", strerror(errno));
+        return false;
+    }
+    if (!st.st_size) {
+        cap_header hdr{};
+        hdr.magic = CAP_MAGIC;
+        hdr.version = CAP_VERSION;
+        hdr.anon = anon;
+        hdr.realtime = std::int64_t(
+            cap_time(CLOCK_REALTIME) - cap_time(CLOCK_MONOTONIC)
+        );
+        if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+            print_err("capture: write failed (%s)", strerror(errno));
+            return false;
+        }
+        return true;
+    }
+    cap_header hdr;
+    if (
+        (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) ||
+        (hdr.magic != CAP_MAGIC) || (hdr.version != CAP_VERSION)
+    ) {
+        print_err("capture: %s exists and is not a capture", path);
+        return false;
+    }
+    if (bool(hdr.anon) != anon) {
+        print_err("capture: %s has a different anonymization", path);
+        return false;
+    }
+    return true;
+}
+
+bool cap_open(char const *path, bool anon) {
+    static bool registered = false;
+    if ((cap_fd >= 0) && (cap_path == path) && (cap_anon == anon)) {
+        return true;
+    }
+    cap_close();
+    if (!*path) {
+        return true;
+    }
+    if (anon && !cap_have_key) {
+        if (getrandom(&cap_key, sizeof(cap_key), 0) != sizeof(cap_key)) {
+            print_err("capture: no key to anonymize (%s)", strerror(errno));
+            return false;
+        }
+        cap_have_key = true;
+    }
+    int fd = open(
+        path, O_RDWR | O_CREAT | O_APPEND | O_NOFOLLOW | O_CLOEXEC, 0600
+    );
+    if (fd < 0) {
+        print_err("capture: failed to open %s (%s)", path, strerror(errno));
+        return false;
+    }
+    if (!cap_check(fd, anon, path)) {
+        close(fd);
+        return false;
+    }
+    if (!registered) {
+        std::atexit(cap_close);
+        registered = true;
+    }
+    cap_fd = fd;
+    cap_pid = getpid();
+    cap_path = path;
+    cap_anon = anon;
+    print_dbg("capture: writing into %s", path);
+    return true;
+}
+
+static bool cap_flush() {
+    std::size_t off = 0;
+    while (off < cap_used) {
+        auto ret = write(cap_fd, &cap_buf[off], cap_used - off);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        off += ret;
+    }
+    cap_used = 0;
+    return true;
+}
+
+void cap_close() {
+    if ((cap_fd < 0) || (getpid() != cap_pid)) {
+        return;
+    }
+    if (!cap_flush()) {
+        print_err("capture: write failed (%s)", strerror(errno));
+    }
+    close(cap_fd);
+    cap_fd = -1;
+    cap_used = 0;
+    cap_path.clear();
+}
+
+void cap_add(cap_code code, int fd, void const *data, std::size_t len) {
+    if (cap_fd < 0) {
+        return;
+    }
+    if (((cap_used + sizeof(cap_entry) + len) > cap_bufsize) && !cap_flush()) {
+        print_err("capture: write failed, stopping (%s)", strerror(errno));
+        cap_used = 0;
+        cap_close();
+        return;
+    }
+    cap_entry ent;
+    ent.time = cap_time(CLOCK_MONOTONIC);
+    ent.fd = fd;
+    ent.code = std::uint16_t(code);
+    ent.len = std::uint16_t(len);
+    std::memcpy(&cap_buf[cap_used], &ent, sizeof(ent));
+    if (len) {
+        std::memcpy(&cap_buf[cap_used + sizeof(ent)], data, len);
+    }
+    cap_used += sizeof(ent) + len;
+}
+
+void cap_handshake(session const &sess) {
+    if (cap_fd < 0) {
+        return;
+    }
+    /* the daemon never accepts strings longer than this */
+    static constexpr std::size_t str_max = 256;
+    char buf[sizeof(cap_session) + CAP_STRINGS * (2 + str_max)];
+    cap_session cs;
+    cs.vtnr = sess.vtnr;
+    cs.uid = cap_anon ? cap_uid(sess.lgn->uid) : sess.lgn->uid;
+    cs.remote = sess.remote;
+    std::memcpy(buf, &cs, sizeof(cs));
+    std::size_t len = sizeof(cs);
+    auto put_str = [&buf, &len](istr const &str) {
+        auto slen = std::uint16_t(std::min(str.size(), str_max));
+        std::memcpy(&buf[len], &slen, sizeof(slen));
+        std::memcpy(&buf[len + sizeof(slen)], str.data(), slen);
+        len += sizeof(slen) + slen;
+    };
+    istr const empty{};
+    put_str(sess.s_service);
+    put_str(sess.s_type);
+    put_str(sess.s_class);
+    put_str(sess.s_desktop);
+    put_str(sess.s_seat);
+    put_str(sess.s_tty);
+    put_str(sess.s_display);
+    put_str(cap_anon ? empty : sess.s_ruser);
+    put_str(cap_anon ? empty : sess.s_rhost);
+    cap_add(CAP_HANDSHAKE, sess.fd, buf, len);
+}
+
+bool cap_get_key(std::uint64_t &key) {
+    key = cap_key;
+    return cap_have_key;
+}
+
+void cap_set_key(std::uint64_t key) {
+    cap_key = key;
+    cap_have_key = true;
+}
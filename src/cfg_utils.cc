@@ -1,34 +1,94 @@
 #include <cctype>
+#include <cerrno>
 #include <cstring>
 #include <cstdlib>
 #include <climits>
 #include <utility>
 
+#include <sched.h>
+
 #include "turnstiled.hh"
 
-static void read_bool(char const *name, char const *value, bool &val) {
+cfg_data *cdata = nullptr;
+
+static void read_bool(
+    char const *name, char const *value, bool &val, bool &valid
+) {
     if (!std::strcmp(value, "yes")) {
         val = true;
     } else if (!std::strcmp(value, "no")) {
         val = false;
     } else {
-        syslog(
+        print_log(
             LOG_WARNING,
             "Invalid configuration value '%s' for '%s' (expected yes/no)",
             value, name
         );
+        valid = false;
+    }
+}
+
+static void read_uint(
+    char const *name, char const *value, time_t &val, bool &valid
+) {
+    char *endp = nullptr;
+    auto tout = std::strtoul(value, &endp, 10);
+    if (*endp || (endp == value)) {
+        print_log(
+            LOG_WARNING,
+            "Invalid config value '%s' for '%s' (expected integer)",
+            value, name
+        );
+        valid = false;
+        return;
+    }
+    val = time_t(tout);
+}
+
+/* a plain count, which unlike the above may not be negative */
+static void read_count(
+    char const *name, char const *value, unsigned long &val, bool &valid
+) {
+    char *endp = nullptr;
+    errno = 0;
+    auto v = std::strtoul(value, &endp, 10);
+    if (!std::isdigit(*value) || *endp || (errno == ERANGE)) {
+        print_log(
+            LOG_WARNING,
+            "Invalid config value '%s' for '%s' (expected count)",
+            value, name
+        );
+        valid = false;
+        return;
     }
+    val = v;
 }
 
-void cfg_read(char const *cfgpath) {
+/* an absolute path with no trailing slash, which is never just '/' */
+static void read_path(
+    char const *name, char const *value, std::string &val, bool &valid
+) {
+    auto vlen = std::strlen(value);
+    if (!vlen || (value[0] != '/') || (value[vlen - 1] == '/')) {
+        print_log(
+            LOG_WARNING, "Invalid config value for '%s' (%s)", name, value
+        );
+        valid = false;
+        return;
+    }
+    val = value;
+}
+
+bool cfg_read(char const *cfgpath, cfg_data &cfg) {
     char buf[1024];
+    bool ret = true;
 
     auto *f = std::fopen(cfgpath, "r");
     if (!f) {
-        syslog(
+        print_log(
             LOG_NOTICE, "No configuration file '%s', using defaults", cfgpath
         );
-        return;
+        return false;
     }
 
     while (std::fgets(buf, sizeof(buf), f)) {
@@ -60,7 +120,8 @@ void cfg_read(char const *cfgpath) {
         char *ass = strchr(bufp, '=');
         /* invalid */
         if (!ass || (ass == bufp)) {
-            syslog(LOG_WARNING, "Malformed configuration line: %s", bufp);
+            print_log(LOG_WARNING, "Malformed configuration line: %s", bufp);
+            ret = false;
             continue;
         }
         *ass = '\0';
@@ -71,68 +132,459 @@ void cfg_read(char const *cfgpath) {
         }
         /* empty name */
         if (preass == bufp) {
-            syslog(LOG_WARNING, "Invalid configuration line name: %s", bufp);
+            print_log(LOG_WARNING, "Invalid configuration line name: %s", bufp);
+            ret = false;
             continue;
         }
         /* find the value */
         while (std::isspace(*++ass)) {
             continue;
         }
-        /* supported config lines */
-        if (!std::strcmp(bufp, "debug")) {
-            read_bool("debug", ass, cdata->debug);
-        } else if (!std::strcmp(bufp, "debug_stderr")) {
-            read_bool("debug_stderr", ass, cdata->debug_stderr);
-        } else if (!std::strcmp(bufp, "manage_rundir")) {
-            read_bool("manage_rundir", ass, cdata->manage_rdir);
-        } else if (!std::strcmp(bufp, "export_dbus_address")) {
-            read_bool("export_dbus_address", ass, cdata->export_dbus);
-        } else if (!std::strcmp(bufp, "root_session")) {
-            read_bool("root_session", ass, cdata->root_session);
-        } else if (!std::strcmp(bufp, "linger")) {
-            if (!std::strcmp(ass, "maybe")) {
-                cdata->linger = false;
-                cdata->linger_never = false;
-            } else {
-                read_bool("linger", ass, cdata->linger);
-                cdata->linger_never = !cdata->linger;
+        cfg_set(cfg, bufp, ass, ret);
+    }
+
+    std::fclose(f);
+    return ret;
+}
+
+/* a list of cpus such as 0-3,8,10-11 */
+bool cfg_parse_cpus(char const *str, std::vector<unsigned int> &cpus) {
+    cpus.clear();
+    while (*str) {
+        char *endp = nullptr;
+        auto lo = std::strtoul(str, &endp, 10);
+        if ((endp == str) || !std::isdigit(*str)) {
+            return false;
+        }
+        auto hi = lo;
+        if (*endp == '-') {
+            str = endp + 1;
+            hi = std::strtoul(str, &endp, 10);
+            if ((endp == str) || !std::isdigit(*str) || (hi < lo)) {
+                return false;
             }
-        } else if (!std::strcmp(bufp, "backend")) {
-            if (!std::strcmp(ass, "none")) {
-                cdata->backend.clear();
-                cdata->disable = true;
-            } else if (!std::strlen(ass)) {
-                syslog(
-                    LOG_WARNING,
-                    "Invalid config value for '%s' (must be non-empty)", bufp
-                );
-            } else {
-                cdata->backend = ass;
+        }
+        if (hi >= CPU_SETSIZE) {
+            return false;
+        }
+        for (auto i = lo; i <= hi; ++i) {
+            cpus.push_back(i);
+        }
+        if (*endp == ',') {
+            ++endp;
+        } else if (*endp && (*endp != '\n')) {
+            return false;
+        }
+        str = endp;
+    }
+    return !cpus.empty();
+}
+
+/* a number, optionally suffixed by K, M, G or T, or infinity */
+static bool read_size(char const *value, unsigned long long &val) {
+    char *endp = nullptr;
+    if (!std::isdigit(*value)) {
+        return false;
+    }
+    val = std::strtoull(value, &endp, 10);
+    unsigned int shift = 0;
+    switch (*endp) {
+        case 'T': shift += 10; [[fallthrough]];
+        case 'G': shift += 10; [[fallthrough]];
+        case 'M': shift += 10; [[fallthrough]];
+        case 'K': shift += 10;
+            ++endp;
+            break;
+        default:
+            break;
+    }
+    if (*endp || (shift && (val > (~0ULL >> shift)))) {
+        return false;
+    }
+    val <<= shift;
+    return true;
+}
+
+static bool read_rlim(char const *value, rlim_t &val) {
+    if (!std::strcmp(value, "infinity")) {
+        val = RLIM_INFINITY;
+        return true;
+    }
+    unsigned long long v;
+    if (!read_size(value, v) || (rlim_t(v) == RLIM_INFINITY)) {
+        return false;
+    }
+    val = rlim_t(v);
+    return true;
+}
+
+static struct {
+    char const *name;
+    int resource;
+} const rlimit_names[] = {
+    {"as", RLIMIT_AS},
+    {"core", RLIMIT_CORE},
+    {"cpu", RLIMIT_CPU},
+    {"data", RLIMIT_DATA},
+    {"fsize", RLIMIT_FSIZE},
+    {"memlock", RLIMIT_MEMLOCK},
+    {"nofile", RLIMIT_NOFILE},
+    {"nproc", RLIMIT_NPROC},
+    {"stack", RLIMIT_STACK},
+};
+
+/* a limit is either the same soft and hard value, or soft:hard */
+static bool read_limit(
+    char const *key, char const *value, cfg_profile::limit &lim
+) {
+    for (auto &rn: rlimit_names) {
+        if (std::strcmp(key, rn.name)) {
+            continue;
+        }
+        lim.resource = rn.resource;
+        std::string cur{value};
+        auto *col = std::strchr(value, ':');
+        if (col) {
+            cur.resize(col - value);
+        }
+        if (!read_rlim(cur.data(), lim.cur)) {
+            return false;
+        }
+        if (!col) {
+            lim.max = lim.cur;
+            return true;
+        }
+        return read_rlim(col + 1, lim.max) && (lim.cur <= lim.max);
+    }
+    return false;
+}
+
+/* I/O scheduling classes of the kernel, as in ioprio_set(2) */
+enum {
+    IOPRIO_RT = 1,
+    IOPRIO_BE = 2,
+    IOPRIO_IDLE = 3,
+};
+
+static bool read_ioprio(char const *value, int &val) {
+    int cls;
+    char const *lvl = nullptr;
+    if (!std::strcmp(value, "idle")) {
+        val = IOPRIO_IDLE << 13;
+        return true;
+    } else if (!std::strncmp(value, "best-effort", 11)) {
+        cls = IOPRIO_BE;
+        lvl = value + 11;
+    } else if (!std::strncmp(value, "realtime", 8)) {
+        cls = IOPRIO_RT;
+        lvl = value + 8;
+    } else {
+        return false;
+    }
+    /* the default level of the class */
+    if (!*lvl) {
+        val = (cls << 13) | 4;
+        return true;
+    }
+    if ((lvl[0] != ':') || (lvl[1] < '0') || (lvl[1] > '7') || lvl[2]) {
+        return false;
+    }
+    val = (cls << 13) | (lvl[1] - '0');
+    return true;
+}
+
+static bool read_sched(char const *value, int &val) {
+    if (!std::strcmp(value, "other")) {
+        val = SCHED_OTHER;
+#if defined(__linux__)
+    } else if (!std::strcmp(value, "batch")) {
+        val = SCHED_BATCH;
+    } else if (!std::strcmp(value, "idle")) {
+        val = SCHED_IDLE;
+#endif
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/* profile.NAME.KEY; returns false for keys that are not known */
+static bool read_profile(
+    cfg_data &cfg, char const *name, char const *value, bool &valid
+) {
+    auto *pname = name + 8;
+    auto *key = std::strchr(pname, '.');
+    if (!key || (key == pname)) {
+        return false;
+    }
+    std::string prname{pname, std::size_t(key - pname)};
+    ++key;
+    cfg_profile *prof = nullptr;
+    for (auto &p: cfg.profiles) {
+        if (p.name == prname) {
+            prof = &p;
+            break;
+        }
+    }
+    if (!prof) {
+        prof = &cfg.profiles.emplace_back();
+        prof->name = std::move(prname);
+    }
+    bool ok = true;
+    char *endp = nullptr;
+    if (!std::strcmp(key, "cpus")) {
+        ok = cfg_parse_cpus(value, prof->cpus);
+    } else if (!std::strcmp(key, "numa_node")) {
+        auto v = std::strtol(value, &endp, 10);
+        ok = (endp != value) && !*endp && (v >= 0);
+        if (ok) {
+            prof->numa_node = v;
+        }
+    } else if (!std::strcmp(key, "nice")) {
+        auto v = std::strtol(value, &endp, 10);
+        ok = (endp != value) && !*endp && (v >= -20) && (v <= 19);
+        if (ok) {
+            prof->nice = int(v);
+            prof->set_nice = true;
+        }
+    } else if (!std::strcmp(key, "ioprio")) {
+        ok = read_ioprio(value, prof->ioprio);
+    } else if (!std::strcmp(key, "sched")) {
+        ok = read_sched(value, prof->sched);
+    } else if (!std::strcmp(key, "cpu_weight")) {
+        auto v = std::strtol(value, &endp, 10);
+        ok = (endp != value) && !*endp && (v >= 1) && (v <= 10000);
+        if (ok) {
+            prof->cpu_weight = v;
+        }
+    } else if (!std::strcmp(key, "memory_high")) {
+        unsigned long long v;
+        if (!std::strcmp(value, "max")) {
+            prof->memory_high = value;
+        } else if ((ok = read_size(value, v))) {
+            prof->memory_high = std::to_string(v);
+        }
+    } else if (!std::strncmp(key, "rlimit_", 7)) {
+        cfg_profile::limit lim;
+        if (!read_limit(key + 7, value, lim)) {
+            /* could be either, so tell which */
+            bool known = false;
+            for (auto &rn: rlimit_names) {
+                known = known || !std::strcmp(key + 7, rn.name);
+            }
+            if (!known) {
+                return false;
             }
-        } else if (!std::strcmp(bufp, "rundir_path")) {
-            std::string rp = ass;
-            if (!rp.empty() && ((rp.back() == '/') || (rp.front() != '/'))) {
-                syslog(
-                    LOG_WARNING,
-                    "Invalid config value for '%s' (%s)", bufp, rp.data()
-                );
-            } else {
-                cdata->rdir_path = std::move(rp);
+            ok = false;
+        } else {
+            bool found = false;
+            for (auto &l: prof->rlimits) {
+                if (l.resource == lim.resource) {
+                    l = lim;
+                    found = true;
+                }
             }
-        } else if (!std::strcmp(bufp, "login_timeout")) {
-            char *endp = nullptr;
-            auto tout = std::strtoul(ass, &endp, 10);
-            if (*endp || (endp == ass)) {
-                syslog(
-                    LOG_WARNING,
-                    "Invalid config value '%s' for '%s' (expected integer)",
-                    ass, bufp
-                );
-            } else {
-                cdata->login_timeout = time_t(tout);
+            if (!found) {
+                prof->rlimits.push_back(lim);
             }
         }
+    } else {
+        return false;
+    }
+    if (!ok) {
+        print_log(
+            LOG_WARNING, "Invalid config value for '%s' (%s)", name, value
+        );
+        valid = false;
+    }
+    return true;
+}
+
+/* profile_user.NAME and profile_class.NAME */
+static void read_assign(
+    std::vector<std::pair<std::string, std::string>> &vec,
+    char const *name, char const *value, bool &valid
+) {
+    if (!*name || !*value) {
+        print_log(
+            LOG_WARNING,
+            "Invalid config value for profile of '%s' (%s)", name, value
+        );
+        valid = false;
+        return;
+    }
+    for (auto &a: vec) {
+        if (a.first == name) {
+            a.second = value;
+            return;
+        }
+    }
+    vec.emplace_back(name, value);
+}
+
+/* the user's own profile comes first, then the one of the class of its
+ * first session, then the default one
+ */
+cfg_profile const *cfg_find_profile(cfg_data const &cfg, login const &lgn) {
+    char const *pname = nullptr;
+    for (auto &a: cfg.profile_users) {
+        if (a.first == lgn.username) {
+            pname = a.second.data();
+            break;
+        }
+    }
+    if (!pname && !lgn.sessions.empty()) {
+        for (auto &a: cfg.profile_classes) {
+            if (a.first == lgn.sessions.front().s_class.data()) {
+                pname = a.second.data();
+                break;
+            }
+        }
+    }
+    bool dflt = !pname;
+    if (dflt) {
+        pname = "default";
+    }
+    for (auto &p: cfg.profiles) {
+        if (p.name == pname) {
+            return &p;
+        }
+    }
+    if (!dflt) {
+        print_err("srv: no profile '%s' for %u", pname, lgn.uid);
+    }
+    return nullptr;
+}
+
+/* returns false for names that are not known, which are otherwise ignored;
+ * invalid values leave the configuration as it was and clear valid
+ */
+bool cfg_set(
+    cfg_data &cfg, char const *name, char const *value, bool &valid
+) {
+    if (!std::strcmp(name, "debug")) {
+        read_bool("debug", value, cfg.debug, valid);
+    } else if (!std::strcmp(name, "debug_stderr")) {
+        read_bool("debug_stderr", value, cfg.debug_stderr, valid);
+    } else if (!std::strcmp(name, "manage_rundir")) {
+        read_bool("manage_rundir", value, cfg.manage_rdir, valid);
+    } else if (!std::strcmp(name, "export_dbus_address")) {
+        read_bool("export_dbus_address", value, cfg.export_dbus, valid);
+    } else if (!std::strcmp(name, "root_session")) {
+        read_bool("root_session", value, cfg.root_session, valid);
+    } else if (!std::strcmp(name, "ready_fd")) {
+        read_bool("ready_fd", value, cfg.ready_fd, valid);
+    } else if (!std::strcmp(name, "unprivileged")) {
+        read_bool("unprivileged", value, cfg.unprivileged, valid);
+    } else if (!std::strcmp(name, "capture_anonymize")) {
+        read_bool("capture_anonymize", value, cfg.capture_anon, valid);
+    } else if (!std::strcmp(name, "linger")) {
+        if (!std::strcmp(value, "maybe")) {
+            cfg.linger = false;
+            cfg.linger_never = false;
+        } else {
+            read_bool("linger", value, cfg.linger, valid);
+            cfg.linger_never = !cfg.linger;
+        }
+    } else if (!std::strcmp(name, "backend")) {
+        if (!std::strcmp(value, "none")) {
+            cfg.backend.clear();
+            cfg.disable = true;
+        } else if (!std::strlen(value)) {
+            print_log(
+                LOG_WARNING,
+                "Invalid config value for '%s' (must be non-empty)", name
+            );
+            valid = false;
+        } else {
+            cfg.backend = value;
+        }
+    } else if (!std::strcmp(name, "rundir_path")) {
+        std::string rp = value;
+        if (!rp.empty() && ((rp.back() == '/') || (rp.front() != '/'))) {
+            print_log(
+                LOG_WARNING,
+                "Invalid config value for '%s' (%s)", name, rp.data()
+            );
+            valid = false;
+        } else {
+            cfg.rdir_path = std::move(rp);
+        }
+    } else if (!std::strcmp(name, "rundir_size")) {
+        /* empty means a plain directory, otherwise as tmpfs takes it */
+        char *endp = nullptr;
+        std::strtoul(value, &endp, 10);
+        if (
+            *value && ((endp == value) || !std::isdigit(*value) || (*endp && (
+                endp[1] || !std::strchr("kKmMgG%", *endp)
+            )))
+        ) {
+            print_log(
+                LOG_WARNING, "Invalid config value for '%s' (%s)", name, value
+            );
+            valid = false;
+        } else {
+            cfg.rdir_size = value;
+        }
+    } else if (!std::strcmp(name, "rundir_inodes")) {
+        read_count("rundir_inodes", value, cfg.rundir_inodes, valid);
+    } else if (!std::strcmp(name, "capture_path")) {
+        /* empty disables the capture */
+        if (!*value) {
+            cfg.capture_path.clear();
+        } else {
+            read_path(name, value, cfg.capture_path, valid);
+        }
+    } else if (!std::strcmp(name, "pressure_path")) {
+        /* empty disables the eviction */
+        if (!*value) {
+            cfg.pressure_path.clear();
+        } else {
+            read_path(name, value, cfg.pressure_path, valid);
+        }
+    } else if (!std::strcmp(name, "cgroup_path")) {
+        /* empty disables the cgroups */
+        if (!*value) {
+            cfg.cgroup_path.clear();
+        } else {
+            read_path(name, value, cfg.cgroup_path, valid);
+        }
+    } else if (!std::strcmp(name, "base_path")) {
+        read_path(name, value, cfg.base_path, valid);
+    } else if (!std::strcmp(name, "linger_path")) {
+        read_path(name, value, cfg.linger_path, valid);
+    } else if (!std::strcmp(name, "state_path")) {
+        read_path(name, value, cfg.state_path, valid);
+    } else if (!std::strcmp(name, "backend_path")) {
+        read_path(name, value, cfg.backend_path, valid);
+    } else if (!std::strcmp(name, "backend_conf_path")) {
+        read_path(name, value, cfg.backend_conf_path, valid);
+    } else if (!std::strcmp(name, "login_timeout")) {
+        read_uint("login_timeout", value, cfg.login_timeout, valid);
+    } else if (!std::strcmp(name, "shutdown_timeout")) {
+        read_uint("shutdown_timeout", value, cfg.shutdown_timeout, valid);
+    } else if (!std::strcmp(name, "restart_limit")) {
+        read_uint("restart_limit", value, cfg.restart_limit, valid);
+    } else if (!std::strcmp(name, "restart_interval")) {
+        read_uint("restart_interval", value, cfg.restart_interval, valid);
+    } else if (!std::strcmp(name, "stats_interval")) {
+        read_uint("stats_interval", value, cfg.stats_interval, valid);
+    } else if (!std::strncmp(name, "profile.", 8)) {
+        return read_profile(cfg, name, value, valid);
+    } else if (!std::strncmp(name, "profile_user.", 13)) {
+        read_assign(cfg.profile_users, name + 13, value, valid);
+    } else if (!std::strncmp(name, "profile_class.", 14)) {
+        read_assign(cfg.profile_classes, name + 14, value, valid);
+    } else if (!std::strcmp(name, "freeze_timeout")) {
+        read_uint("freeze_timeout", value, cfg.freeze_timeout, valid);
+    } else if (!std::strcmp(name, "pressure_stall")) {
+        read_uint("pressure_stall", value, cfg.pressure_stall, valid);
+    } else if (!std::strcmp(name, "pressure_window")) {
+        read_uint("pressure_window", value, cfg.pressure_window, valid);
+    } else {
+        return false;
     }
+    return true;
 }
 
 void cfg_expand_rundir(
@@ -0,0 +1,475 @@
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <dirent.h>
+#if defined(__linux__)
+#include <sys/vfs.h>
+#include <sys/inotify.h>
+#include <linux/magic.h>
+#endif
+
+#include "turnstiled.hh"
+
+#if defined(__linux__)
+
+/* the cgroups of the logins are all in one directory of the cgroup2
+ * hierarchy, named user-UID; whether they are empty is watched with
+ * inotify on their cgroup.events, and the inotify descriptor raises a
+ * SIGIO, so that it comes in through the signal pipe like everything
+ * else and is also handled while shutting down
+ */
+static std::string cg_base;
+static int cg_dfd = -1;
+static int cg_ifd = -1;
+
+static void cg_name(
+    char *buf, std::size_t len, unsigned int uid, char const *file = nullptr
+) {
+    if (file) {
+        std::snprintf(buf, len, "user-%u/%s", uid, file);
+    } else {
+        std::snprintf(buf, len, "user-%u", uid);
+    }
+}
+
+/* write a short string into a cgroup file */
+static bool cg_write(int dfd, char const *name, char const *str) {
+    int fd = openat(dfd, name, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    auto len = std::strlen(str);
+    bool ret = (write(fd, str, len) == ssize_t(len));
+    int err = errno;
+    close(fd);
+    errno = err;
+    return ret;
+}
+
+/* whether there is anything left in the cgroup or below, -1 on error */
+static int cg_populated(int dfd, char const *name) {
+    int fd = openat(dfd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    char buf[256];
+    auto ret = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (ret <= 0) {
+        return -1;
+    }
+    buf[ret] = '\0';
+    for (char *line = buf; line; line = std::strchr(line, '\n')) {
+        if (*line == '\n') {
+            ++line;
+        }
+        if (!std::strncmp(line, "populated ", 10)) {
+            return (line[10] != '0');
+        }
+    }
+    return -1;
+}
+
+/* without cgroup.kill (before linux 5.14), everything in the subtree is
+ * killed one by one; anything forked meanwhile is caught when the cgroup
+ * is found to be still populated later on
+ */
+static void cg_kill_procs(int dfd) {
+    int fd = openat(dfd, "cgroup.procs", O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        auto *f = fdopen(fd, "rb");
+        if (f) {
+            long pid;
+            while (std::fscanf(f, "%ld", &pid) == 1) {
+                kill(pid_t(pid), SIGKILL);
+            }
+            std::fclose(f);
+        } else {
+            close(fd);
+        }
+    }
+    int sfd = dup(dfd);
+    auto *d = (sfd >= 0) ? fdopendir(sfd) : nullptr;
+    if (!d) {
+        if (sfd >= 0) {
+            close(sfd);
+        }
+        return;
+    }
+    while (auto *dent = readdir(d)) {
+        if ((dent->d_type != DT_DIR) || (dent->d_name[0] == '.')) {
+            continue;
+        }
+        int cfd = openat(
+            dfd, dent->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC
+        );
+        if (cfd >= 0) {
+            cg_kill_procs(cfd);
+            close(cfd);
+        }
+    }
+    closedir(d);
+}
+
+static bool cg_kill_at(int dfd, char const *name) {
+    int cfd = openat(dfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (cfd < 0) {
+        return false;
+    }
+    bool ret = cg_write(cfd, "cgroup.kill", "1");
+    if (!ret && (errno == ENOENT)) {
+        cg_kill_procs(cfd);
+        ret = true;
+    }
+    close(cfd);
+    return ret;
+}
+
+/* the service manager may have made cgroups of its own, which have to
+ * go first; the interface files go away along with their directories
+ */
+static bool cg_remove_at(int dfd, char const *name) {
+    int cfd = openat(dfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (cfd < 0) {
+        return (errno == ENOENT);
+    }
+    auto *d = fdopendir(cfd);
+    if (!d) {
+        close(cfd);
+        return false;
+    }
+    while (auto *dent = readdir(d)) {
+        if ((dent->d_type != DT_DIR) || (dent->d_name[0] == '.')) {
+            continue;
+        }
+        cg_remove_at(dirfd(d), dent->d_name);
+    }
+    closedir(d);
+    return !unlinkat(dfd, name, AT_REMOVEDIR) || (errno == ENOENT);
+}
+
+/* whatever is left over from a previous instance of the daemon; it is
+ * all killed first and then given a moment to go away before removal
+ */
+static void cg_sweep() {
+    std::vector<std::string> names;
+    int sfd = dup(cg_dfd);
+    auto *d = (sfd >= 0) ? fdopendir(sfd) : nullptr;
+    if (!d) {
+        if (sfd >= 0) {
+            close(sfd);
+        }
+        print_err(
+            "cgroup: failed to read %s (%s)", cg_base.data(), strerror(errno)
+        );
+        return;
+    }
+    while (auto *dent = readdir(d)) {
+        if (
+            (dent->d_type != DT_DIR) ||
+            std::strncmp(dent->d_name, "user-", 5)
+        ) {
+            continue;
+        }
+        print_dbg("cgroup: sweep %s", dent->d_name);
+        cg_kill_at(cg_dfd, dent->d_name);
+        names.emplace_back(dent->d_name);
+    }
+    closedir(d);
+    /* anything still dying after that is reused or swept next time */
+    for (int tries = 0; !names.empty() && (tries < 50); ++tries) {
+        for (auto it = names.begin(); it != names.end();) {
+            if (cg_remove_at(cg_dfd, it->data())) {
+                it = names.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        if (!names.empty()) {
+            usleep(10000);
+        }
+    }
+}
+
+bool cg_init(char const *path, bool sweep) {
+    if (!*path) {
+        return true;
+    }
+    bool made = !mkdir(path, 0755);
+    if (!made && (errno != EEXIST)) {
+        print_err("cgroup: failed to make %s (%s)", path, strerror(errno));
+        return false;
+    }
+    int dfd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (dfd < 0) {
+        print_err("cgroup: failed to open %s (%s)", path, strerror(errno));
+        return false;
+    }
+    struct statfs sfs;
+    if ((fstatfs(dfd, &sfs) < 0) || (sfs.f_type != CGROUP2_SUPER_MAGIC)) {
+        print_err("cgroup: %s is not in a cgroup2 hierarchy", path);
+        close(dfd);
+        if (made) {
+            rmdir(path);
+        }
+        return false;
+    }
+    int ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (
+        (ifd < 0) || (fcntl(ifd, F_SETOWN, getpid()) < 0) ||
+        (fcntl(ifd, F_SETFL, fcntl(ifd, F_GETFL) | O_ASYNC) < 0)
+    ) {
+        print_err("cgroup: failed to set up inotify (%s)", strerror(errno));
+        if (ifd >= 0) {
+            close(ifd);
+        }
+        close(dfd);
+        return false;
+    }
+    cg_base = path;
+    cg_dfd = dfd;
+    cg_ifd = ifd;
+    if (sweep) {
+        cg_sweep();
+    }
+    print_dbg("cgroup: using %s", path);
+    return true;
+}
+
+bool cg_make(login &lgn, bool create) {
+    if (cg_dfd < 0) {
+        return false;
+    }
+    char buf[64];
+    cg_name(buf, sizeof(buf), lgn.uid);
+    if (create) {
+        if ((mkdirat(cg_dfd, buf, 0755) < 0) && (errno != EEXIST)) {
+            print_err(
+                "cgroup: failed to make cgroup for %u (%s)",
+                lgn.uid, strerror(errno)
+            );
+            return false;
+        }
+        /* delegate it, so the service manager can manage its subtree */
+        if (!lgn.cfg->unprivileged) {
+            char const *files[] = {
+                nullptr, "cgroup.procs", "cgroup.threads",
+                "cgroup.subtree_control",
+            };
+            for (auto *file: files) {
+                char fbuf[96];
+                cg_name(fbuf, sizeof(fbuf), lgn.uid, file);
+                if (fchownat(
+                    cg_dfd, fbuf, lgn.uid, lgn.gid, AT_SYMLINK_NOFOLLOW
+                ) < 0) {
+                    print_err(
+                        "cgroup: failed to delegate %s (%s)",
+                        fbuf, strerror(errno)
+                    );
+                    return false;
+                }
+            }
+        }
+    }
+    auto epath = cg_base + "/" + buf + "/cgroup.events";
+    int wd = inotify_add_watch(cg_ifd, epath.data(), IN_MODIFY);
+    if (wd < 0) {
+        if (create || (errno != ENOENT)) {
+            print_err(
+                "cgroup: failed to watch %s (%s)", epath.data(), strerror(errno)
+            );
+        }
+        return false;
+    }
+    lgn.cg_wd = wd;
+    return true;
+}
+
+int cg_dirfd() {
+    return cg_dfd;
+}
+
+bool cg_enter(login const &lgn) {
+    char buf[64];
+    cg_name(buf, sizeof(buf), lgn.uid, "cgroup.procs");
+    return cg_write(cg_dfd, buf, "0");
+}
+
+bool cg_kill(login const &lgn) {
+    if (lgn.cg_wd < 0) {
+        return false;
+    }
+    char buf[64];
+    cg_name(buf, sizeof(buf), lgn.uid);
+    if (!cg_kill_at(cg_dfd, buf)) {
+        print_err(
+            "cgroup: failed to kill cgroup of %u (%s)", lgn.uid, strerror(errno)
+        );
+        return false;
+    }
+    return true;
+}
+
+bool cg_freeze(login const &lgn, bool freeze) {
+    if (lgn.cg_wd < 0) {
+        return false;
+    }
+    char buf[64];
+    cg_name(buf, sizeof(buf), lgn.uid, "cgroup.freeze");
+    if (!cg_write(cg_dfd, buf, freeze ? "1" : "0")) {
+        print_err(
+            "cgroup: failed to %s cgroup of %u (%s)",
+            freeze ? "freeze" : "thaw", lgn.uid, strerror(errno)
+        );
+        return false;
+    }
+    return true;
+}
+
+/* a limit of the cgroup, set up in the parent if need be; writing the
+ * default into a controller that is not enabled is not an error
+ */
+static bool cg_set(
+    login const &lgn, char const *ctl, char const *file,
+    char const *val, bool dflt
+) {
+    char buf[64];
+    cg_name(buf, sizeof(buf), lgn.uid, file);
+    if (cg_write(cg_dfd, buf, val)) {
+        return true;
+    }
+    if (errno == ENOENT) {
+        if (dflt) {
+            return true;
+        }
+        char cbuf[16];
+        std::snprintf(cbuf, sizeof(cbuf), "+%s", ctl);
+        if (cg_write(cg_dfd, "cgroup.subtree_control", cbuf)) {
+            if (cg_write(cg_dfd, buf, val)) {
+                return true;
+            }
+        }
+    }
+    print_err(
+        "cgroup: failed to set %s of %u to %s (%s)",
+        file, lgn.uid, val, strerror(errno)
+    );
+    return false;
+}
+
+bool cg_limit(login const &lgn, cfg_profile const *prof) {
+    if (lgn.cg_wd < 0) {
+        return false;
+    }
+    /* the cgroup may be reused, so it always gets the whole set */
+    char wbuf[32] = "100";
+    char const *mem = "max";
+    if (prof && (prof->cpu_weight > 0)) {
+        std::snprintf(wbuf, sizeof(wbuf), "%ld", prof->cpu_weight);
+    }
+    if (prof && !prof->memory_high.empty()) {
+        mem = prof->memory_high.data();
+    }
+    bool ret = cg_set(
+        lgn, "cpu", "cpu.weight", wbuf, !prof || (prof->cpu_weight <= 0)
+    );
+    return cg_set(
+        lgn, "memory", "memory.high", mem, !prof || prof->memory_high.empty()
+    ) && ret;
+}
+
+bool cg_drop(login &lgn) {
+    if (lgn.cg_wd < 0) {
+        return true;
+    }
+    char buf[64];
+    cg_name(buf, sizeof(buf), lgn.uid, "cgroup.events");
+    if (cg_populated(cg_dfd, buf) != 0) {
+        return false;
+    }
+    cg_name(buf, sizeof(buf), lgn.uid);
+    if (!cg_remove_at(cg_dfd, buf)) {
+        /* something got in meanwhile, we will be notified again */
+        return false;
+    }
+    /* removing the cgroup drops the watch along with it */
+    lgn.cg_wd = -1;
+    return true;
+}
+
+bool cg_events(std::vector<int> &wds) {
+    wds.clear();
+    if (cg_ifd < 0) {
+        return true;
+    }
+    alignas(inotify_event) char buf[4096];
+    for (;;) {
+        auto ret = read(cg_ifd, buf, sizeof(buf));
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN);
+        }
+        for (long pos = 0; pos < ret;) {
+            auto *ev = reinterpret_cast<inotify_event *>(buf + pos);
+            pos += sizeof(inotify_event) + ev->len;
+            if (ev->mask & IN_MODIFY) {
+                wds.push_back(ev->wd);
+            }
+        }
+    }
+}
+
+#else
+
+bool cg_init(char const *path, bool) {
+    if (*path) {
+        print_err("cgroup: not supported on this system");
+        return false;
+    }
+    return true;
+}
+
+bool cg_make(login &, bool) {
+    return false;
+}
+
+int cg_dirfd() {
+    return -1;
+}
+
+bool cg_enter(login const &) {
+    errno = ENOTSUP;
+    return false;
+}
+
+bool cg_kill(login const &) {
+    return false;
+}
+
+bool cg_freeze(login const &, bool) {
+    return false;
+}
+
+bool cg_limit(login const &, cfg_profile const *) {
+    return false;
+}
+
+bool cg_drop(login &lgn) {
+    lgn.cg_wd = -1;
+    return true;
+}
+
+bool cg_events(std::vector<int> &wds) {
+    wds.clear();
+    return true;
+}
+
+#endif
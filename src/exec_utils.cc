@@ -1,14 +1,19 @@
+#include <cstdio>
 #include <cstring>
 
 #include <pwd.h>
 #include <grp.h>
 #include <poll.h>
 #include <fcntl.h>
+#include <sched.h>
 #include <unistd.h>
 #include <paths.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/resource.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
 
 #include "turnstiled.hh"
 
@@ -23,9 +28,10 @@
 #endif
 
 static bool exec_backend(
-    char const *backend, char const *arg, char const *data,
-    unsigned int uid, unsigned int gid, pid_t &outpid
+    login const &lgn, char const *backend, char const *arg, char const *data,
+    pid_t &outpid
 ) {
+    auto path = lgn.cfg->backend_path + "/" + backend;
     auto pid = fork();
     if (pid < 0) {
         /* unrecoverable */
@@ -36,25 +42,18 @@ static bool exec_backend(
         outpid = pid;
         return true;
     }
-    if (!backend) {
-        /* if service manager is not managed, simply succeed immediately */
-        exit(0);
-        return true;
-    }
     /* child process */
-    if (getuid() == 0) {
-        if (setgid(gid) != 0) {
+    if (!lgn.cfg->unprivileged) {
+        if (setgid(lgn.gid) != 0) {
             perror("srv: failed to set gid");
             exit(1);
         }
-        if (setuid(uid) != 0) {
+        if (setuid(lgn.uid) != 0) {
             perror("srv: failed to set uid");
             exit(1);
         }
     }
-    char buf[sizeof(LIBEXEC_PATH) + 128];
-    std::snprintf(buf, sizeof(buf), LIBEXEC_PATH "/%s", backend);
-    execl(buf, buf, arg, data, nullptr);
+    execl(path.data(), path.data(), arg, data, nullptr);
     exit(1);
     return true;
 }
@@ -62,7 +61,7 @@ static bool exec_backend(
 bool srv_boot(login &lgn, char const *backend) {
     print_dbg("srv: startup (ready)");
     if (!exec_backend(
-        backend, "ready", lgn.srvstr.data(), lgn.uid, lgn.gid, lgn.start_pid
+        lgn, backend, "ready", lgn.srvstr.data(), lgn.start_pid
     )) {
         print_err("srv: fork failed (%s)", strerror(errno));
         return false;
@@ -123,6 +122,76 @@ static void sanitize_limits() {
     }
 }
 
+#if defined(__linux__)
+/* the cpus of a numa node as the kernel lists them */
+static bool node_cpus(long node, std::vector<unsigned int> &cpus) {
+    char buf[64];
+    std::snprintf(
+        buf, sizeof(buf), "/sys/devices/system/node/node%ld/cpulist", node
+    );
+    auto *f = std::fopen(buf, "rb");
+    if (!f) {
+        return false;
+    }
+    char lbuf[1024];
+    bool ret = std::fgets(lbuf, sizeof(lbuf), f);
+    std::fclose(f);
+    return ret && cfg_parse_cpus(lbuf, cpus);
+}
+#endif
+
+/* the resource profile goes after the PAM session, so that it overrides
+ * whatever limits the modules may have set; nothing here is fatal
+ */
+static void apply_profile(cfg_profile const *prof) {
+    if (!prof) {
+        return;
+    }
+    print_dbg("srv: apply profile %s", prof->name.data());
+    for (auto &lim: prof->rlimits) {
+        struct rlimit l{lim.cur, lim.max};
+        if (setrlimit(lim.resource, &l) < 0) {
+            perror("srv: failed to set rlimit");
+        }
+    }
+    if (prof->set_nice && (setpriority(PRIO_PROCESS, 0, prof->nice) < 0)) {
+        perror("srv: failed to set nice value");
+    }
+#if defined(__linux__)
+    if (prof->sched >= 0) {
+        struct sched_param sp{};
+        if (sched_setscheduler(0, prof->sched, &sp) < 0) {
+            perror("srv: failed to set scheduling policy");
+        }
+    }
+    /* glibc has no wrapper; 1 is IOPRIO_WHO_PROCESS */
+    if (
+        (prof->ioprio >= 0) &&
+        (syscall(SYS_ioprio_set, 1, 0, prof->ioprio) < 0)
+    ) {
+        perror("srv: failed to set I/O priority");
+    }
+    std::vector<unsigned int> ncpus;
+    auto *cpus = &prof->cpus;
+    if (cpus->empty() && (prof->numa_node >= 0)) {
+        if (!node_cpus(prof->numa_node, ncpus)) {
+            perror("srv: failed to read cpus of node");
+        }
+        cpus = &ncpus;
+    }
+    if (!cpus->empty()) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (auto cpu: *cpus) {
+            CPU_SET(cpu, &set);
+        }
+        if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+            perror("srv: failed to set cpu affinity");
+        }
+    }
+#endif
+}
+
 static bool dpam_open(pam_handle_t *pamh) {
     if (!pamh) {
         return false;
@@ -162,9 +231,14 @@ static void sig_handler(int sign) {
     write(sigpipe[1], &sign, sizeof(sign));
 }
 
+/* the process that opened the PAM session stays around as the parent of
+ * the service manager for as long as it runs; modules such as pam_keyinit,
+ * pam_limits or pam_elogind act on the calling process, so the manager has
+ * to descend from it, and the session is closed with the very handle that
+ * opened it, which is why this cannot be shared between users
+ */
 static void fork_and_wait(
-    pam_handle_t *pamh, char const *backend,
-    unsigned int uid, unsigned int gid
+    pam_handle_t *pamh, login const &lgn, char const *backend, int readyfd
 ) {
     int pst, status;
     int term_count = 0;
@@ -191,6 +265,14 @@ static void fork_and_wait(
         perror("srv: fork failed");
         goto fail;
     }
+    /* these are only kept for the service manager */
+    if (readyfd >= 0) {
+        close(readyfd);
+    }
+    close(lgn.dirfd);
+    if (cg_dirfd() >= 0) {
+        close(cg_dirfd());
+    }
     /* ignore signals */
     sigfillset(&mask);
     sigdelset(&mask, SIGTERM);
@@ -224,14 +306,14 @@ static void fork_and_wait(
             char buf[32];
             pid_t outp;
             int st;
-            if ((term_count++ > 1) || !backend) {
-                /* hard kill */
+            if (term_count++ > 0) {
+                /* hard kill on a repeated request */
                 kill(p, SIGKILL);
                 continue;
             }
             std::snprintf(buf, sizeof(buf), "%zu", size_t(p));
             /* otherwise run the stop part */
-            if (!exec_backend(backend, "stop", buf, uid, gid, outp)) {
+            if (!exec_backend(lgn, backend, "stop", buf, outp)) {
                 /* failed? */
                 perror("srv: stop exec failed, fall back to TERM");
                 kill(p, SIGTERM);
@@ -279,41 +361,23 @@ fail:
     exit(1);
 }
 
-/* dummy "service manager" child process with none backend */
-static void srv_dummy(unsigned int uid) {
-    /* block all signals except the ones we need to terminate */
-    sigset_t mask;
-    sigfillset(&mask);
-    /* kill/stop are ignored, but term is not */
-    sigdelset(&mask, SIGTERM);
-    sigprocmask(SIG_SETMASK, &mask, nullptr);
-    /* mark as ready */
-    char path[4096];
-    std::snprintf(
-        path, sizeof(path), "%s/%s/%u/ready", RUN_PATH, SOCK_DIR, uid
-    );
-    FILE *ready = std::fopen(path, "w");
-    if (!ready) {
-        perror("srv: could not open readiness fifo");
-        exit(1);
-    }
-    std::fprintf(ready, "boop\n");
-    std::fclose(ready);
-    /* this will sleep until a termination signal wakes it */
-    pause();
-    /* in which case just exit */
-    exit(0);
-}
-
-void srv_child(login &lgn, char const *backend, bool make_rundir) {
+void srv_child(
+    login &lgn, char const *backend, bool make_rundir, int readyfd,
+    cfg_profile const *prof
+) {
     pam_handle_t *pamh = nullptr;
-    bool is_root = (getuid() == 0);
+    bool switch_id = !lgn.cfg->unprivileged;
     /* create a new session */
     if (setsid() < 0) {
         perror("srv: setsid failed");
     }
+    /* this process stays around for as long as the service manager runs,
+     * so it must not keep anything of the daemon's open, and neither
+     * should the modules get to see any of it
+     */
+    fd_close_except({readyfd, lgn.dirfd, cg_dirfd()});
     /* begin pam session setup */
-    if (is_root) {
+    if (switch_id) {
         print_dbg("srv: establish pam");
         pamh = dpam_begin(lgn.username.data(), lgn.gid);
         if (!dpam_open(pamh)) {
@@ -326,7 +390,7 @@ void srv_child(login &lgn, char const *backend, bool make_rundir) {
      */
     if (make_rundir) {
         print_dbg("srv: setup rundir for %u", lgn.uid);
-        if (!rundir_make(lgn.rundir.data(), lgn.uid, lgn.gid)) {
+        if (!rundir_make(lgn.rundir.data(), lgn.uid, lgn.gid, *lgn.cfg)) {
             return;
         }
     }
@@ -334,9 +398,17 @@ void srv_child(login &lgn, char const *backend, bool make_rundir) {
     /* handle the parent/child logic here
      * if we're forking, only child makes it past this func
      */
-    fork_and_wait(pamh, backend, lgn.uid, lgn.gid);
+    fork_and_wait(pamh, lgn, backend, readyfd);
+    /* move into the cgroup of the login, after the PAM session so that
+     * no module puts it anywhere else; the process holding the session
+     * stays out of it, so that killing the cgroup does not take it along
+     */
+    if ((lgn.cg_wd >= 0) && !cg_enter(lgn)) {
+        perror("srv: failed to enter cgroup");
+    }
+    apply_profile(prof);
     /* drop privs */
-    if (is_root) {
+    if (switch_id) {
         /* change identity */
         if (setgid(lgn.gid) != 0) {
             perror("srv: failed to set gid");
@@ -347,11 +419,6 @@ void srv_child(login &lgn, char const *backend, bool make_rundir) {
             return;
         }
     }
-    /* dummy service manager if requested */
-    if (!backend) {
-        srv_dummy(lgn.uid);
-        return;
-    }
     /* change directory to home, fall back to / or error */
     if ((chdir(lgn.homedir.data()) < 0) && (chdir("/") < 0)) {
         perror("srv: failed to change directory");
@@ -381,16 +448,23 @@ void srv_child(login &lgn, char const *backend, bool make_rundir) {
         execs.push_back('\0');
         ++nexec;
     };
+    auto *base = lgn.cfg->base_path.data();
     /* path to run script, argv starts here */
-    add_str(LIBEXEC_PATH, "/", backend);
+    add_str(lgn.cfg->backend_path.data(), "/", backend);
     /* arg1: action */
     add_str("run");
-    /* arg1: ready pipe */
-    add_str(RUN_PATH, "/", SOCK_DIR, "/", uidbuf, "/ready");
+    /* arg1: ready pipe, either a path or an inherited descriptor, which
+     * is always 3 so that backends can redirect to it in any shell
+     */
+    if (readyfd >= 0) {
+        add_str("3");
+    } else {
+        add_str(base, "/", SOCK_DIR, "/", uidbuf, "/ready");
+    }
     /* arg2: srvdir */
-    add_str(RUN_PATH, "/", SOCK_DIR, "/", uidbuf, "/", tdirn);
+    add_str(base, "/", SOCK_DIR, "/", uidbuf, "/", tdirn);
     /* arg3: confdir */
-    add_str(CONF_PATH, "/backend");
+    add_str(lgn.cfg->backend_conf_path.data());
     argc = nexec;
     /* pam env vars take preference */
     bool have_env_shell   = false, have_env_user   = false,
@@ -466,6 +540,19 @@ void srv_child(login &lgn, char const *backend, bool make_rundir) {
     }
     /* finish pam before execing */
     dpam_finalize(pamh);
+    /* last, as this replaces whatever was there */
+    if (readyfd >= 0) {
+        if (readyfd != 3) {
+            if (dup2(readyfd, 3) < 0) {
+                perror("srv: failed to pass ready pipe");
+                return;
+            }
+            close(readyfd);
+        } else if (fcntl(readyfd, F_SETFD, 0) < 0) {
+            perror("srv: failed to pass ready pipe");
+            return;
+        }
+    }
     /* fire */
     auto *argv = const_cast<char **>(&argp[0]);
     execve(argv[0], argv, argv + argc + 1);
@@ -1,15 +1,36 @@
+#include <algorithm>
 #include <cstdlib>
 #include <cstddef>
+#include <cstdint>
 #include <cstring>
 #include <climits>
 #include <cerrno>
+#include <ctime>
+#include <string>
+#include <vector>
 
 #include <fcntl.h>
+#include <signal.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <sys/socket.h>
+#if defined(__linux__)
+#include <sys/mount.h>
+#include <sys/syscall.h>
+#endif
 
 #include "turnstiled.hh"
 
+/* the helper process that removes directories in the background, and
+ * the socket to hand over paths to it; the paths are always renamed
+ * aside first, so that the original name can be reused right away
+ */
+static int gc_sock = -1;
+/* makes the aside names unique; it starts from the clock, so that a new
+ * image after an upgrade does not reuse names still waiting for removal
+ */
+static unsigned long long gc_seq = 0;
+
 int dir_make_at(int dfd, char const *dname, mode_t mode) {
     int sdfd = openat(dfd, dname, O_RDONLY | O_NOFOLLOW);
     struct stat st;
@@ -52,7 +73,59 @@ ret_err:
     return -1;
 }
 
-bool rundir_make(char *rundir, unsigned int uid, unsigned int gid) {
+/* a tmpfs of its own for the rundir, so that one user cannot fill up the
+ * whole of /run and removing it does not depend on how much is inside
+ */
+static bool rundir_mount(
+    int bfd, char const *dirbase, char const *rundir,
+    unsigned int uid, unsigned int gid, cfg_data const &cfg
+) {
+#if defined(__linux__)
+    struct stat pst, dst;
+    if (
+        (fstat(bfd, &pst) < 0) ||
+        (fstatat(bfd, dirbase, &dst, AT_SYMLINK_NOFOLLOW) < 0)
+    ) {
+        print_err("rundir: failed to stat %s (%s)", rundir, strerror(errno));
+        return false;
+    }
+    if (pst.st_dev != dst.st_dev) {
+        print_dbg("rundir: %s is already mounted", rundir);
+        return true;
+    }
+    char opts[128];
+    auto olen = std::snprintf(
+        opts, sizeof(opts), "mode=0700,uid=%u,gid=%u,size=%s",
+        uid, gid, cfg.rdir_size.data()
+    );
+    if (cfg.rundir_inodes && (std::size_t(olen) < sizeof(opts))) {
+        std::snprintf(
+            opts + olen, sizeof(opts) - olen, ",nr_inodes=%lu",
+            cfg.rundir_inodes
+        );
+    }
+    print_dbg("rundir: mount tmpfs at %s (%s)", rundir, opts);
+    if (mount("tmpfs", rundir, "tmpfs", MS_NOSUID | MS_NODEV, opts) < 0) {
+        print_err(
+            "rundir: failed to mount tmpfs at %s (%s)", rundir, strerror(errno)
+        );
+        return false;
+    }
+    return true;
+#else
+    (void)bfd;
+    (void)dirbase;
+    (void)uid;
+    (void)gid;
+    (void)cfg;
+    print_err("rundir: cannot mount %s, not supported on this system", rundir);
+    return false;
+#endif
+}
+
+bool rundir_make(
+    char *rundir, unsigned int uid, unsigned int gid, cfg_data const &cfg
+) {
     struct stat dstat;
     int bfd = open("/", O_RDONLY | O_NOFOLLOW);
     if (bfd < 0) {
@@ -115,111 +188,396 @@ bool rundir_make(char *rundir, unsigned int uid, unsigned int gid) {
         close(bfd);
         return false;
     }
-    if (fchownat(bfd, dirbase, uid, gid, AT_SYMLINK_NOFOLLOW) < 0) {
+    if (
+        !cfg.unprivileged &&
+        (fchownat(bfd, dirbase, uid, gid, AT_SYMLINK_NOFOLLOW) < 0)
+    ) {
         print_err("rundir: fchownat failed for rundir (%s)", strerror(errno));
         close(bfd);
         return false;
     }
+    if (
+        !cfg.rdir_size.empty() &&
+        !rundir_mount(bfd, dirbase, rundir, uid, gid, cfg)
+    ) {
+        close(bfd);
+        return false;
+    }
     close(bfd);
     return true;
 }
 
 void rundir_clear(char const *rundir) {
-    struct stat dstat;
+    char pbuf[PATH_MAX];
     print_dbg("rundir: clear directory %s", rundir);
-    int dfd = open(rundir, O_RDONLY | O_NOFOLLOW);
+    auto *sl = std::strrchr(rundir, '/');
+    if (!sl || !sl[1] || (std::size_t(sl - rundir) >= sizeof(pbuf))) {
+        print_dbg("rundir: invalid path %s", rundir);
+        return;
+    }
+    /* the parent path, or root */
+    auto plen = std::size_t(sl - rundir);
+    std::memcpy(pbuf, rundir, plen);
+    if (!plen) {
+        pbuf[plen++] = '/';
+    }
+    pbuf[plen] = '\0';
+    int pfd = open(pbuf, O_RDONLY | O_DIRECTORY);
     /* non-existent */
+    if (pfd < 0) {
+        return;
+    }
+#if defined(__linux__)
+    /* a tmpfs goes away with everything in it, leaving an empty directory;
+     * whatever still has files open in it keeps them until it closes them
+     */
+    struct stat pst, dst;
+    if (
+        !fstat(pfd, &pst) &&
+        !fstatat(pfd, sl + 1, &dst, AT_SYMLINK_NOFOLLOW) &&
+        S_ISDIR(dst.st_mode) && (pst.st_dev != dst.st_dev)
+    ) {
+        print_dbg("rundir: unmount %s", rundir);
+        if (umount2(rundir, MNT_DETACH | UMOUNT_NOFOLLOW) < 0) {
+            print_err(
+                "rundir: failed to unmount %s (%s)", rundir, strerror(errno)
+            );
+        }
+    }
+#endif
+    dir_remove_async(pfd, pbuf, sl + 1);
+    close(pfd);
+}
+
+static bool dir_remove_now(int pdfd, char const *name) {
+    int dfd = openat(pdfd, name, O_RDONLY | O_NOFOLLOW | O_DIRECTORY);
     if (dfd < 0) {
+        return false;
+    }
+    if (!dir_clear_contents(dfd)) {
+        print_dbg("dir_remove: failed to clear contents of %s", name);
+        return false;
+    }
+    /* was empty */
+    return !unlinkat(pdfd, name, AT_REMOVEDIR);
+}
+
+/* hands a directory that was already moved aside over to the helper */
+static void dir_gc_queue(int pdfd, char const *ppath, char const *gname) {
+    char pbuf[PATH_MAX];
+    auto plen = std::snprintf(pbuf, sizeof(pbuf), "%s/%s", ppath, gname);
+    if ((gc_sock < 0) || (plen < 0) || (std::size_t(plen) >= sizeof(pbuf)) || (
+        send(gc_sock, pbuf, plen, MSG_DONTWAIT | MSG_NOSIGNAL) < 0
+    )) {
+        /* helper is gone or backed up, do it ourselves */
+        print_dbg("dir_remove: could not queue %s/%s", ppath, gname);
+        dir_remove_now(pdfd, gname);
         return;
     }
-    /* an error? */
-    if (fstat(dfd, &dstat)) {
-        print_dbg("rundir: could not stat %s (%s)", rundir, strerror(errno));
-        close(dfd);
+    print_dbg("dir_remove: queued %s", pbuf);
+}
+
+void dir_remove_async(int pdfd, char const *ppath, char const *name) {
+    struct stat dstat;
+    if (
+        (fstatat(pdfd, name, &dstat, AT_SYMLINK_NOFOLLOW) < 0) ||
+        !S_ISDIR(dstat.st_mode)
+    ) {
+        /* non-existent or not a directory */
         return;
     }
-    /* not a directory */
-    if (!S_ISDIR(dstat.st_mode)) {
-        print_dbg("rundir: %s is not a directory", rundir);
-        close(dfd);
+    if (gc_sock < 0) {
+        dir_remove_now(pdfd, name);
         return;
     }
-    if (dir_clear_contents(dfd)) {
-        /* was empty */
-        rmdir(rundir);
-    } else {
-        print_dbg("rundir: failed to clear contents of %s", rundir);
+    /* move it out of the way first; this is atomic and cheap */
+    char gname[NAME_MAX + 1];
+    std::snprintf(gname, sizeof(gname), ".gc.%llu.%s", ++gc_seq, name);
+    if (renameat(pdfd, name, pdfd, gname) < 0) {
+        print_dbg("dir_remove: could not move %s (%s)", name, strerror(errno));
+        dir_remove_now(pdfd, name);
+        return;
     }
+    dir_gc_queue(pdfd, ppath, gname);
 }
 
-bool dir_clear_contents(int dfd) {
+void dir_gc_sweep(char const *path) {
+    int dfd = open(path, O_RDONLY | O_NOFOLLOW | O_DIRECTORY);
     if (dfd < 0) {
-        /* silently return if an invalid file descriptor */
-        return false;
+        return;
     }
-    DIR *d = fdopendir(dfd);
-    if (!d) {
-        print_err("dir_clear: fdopendir failed (%s)", strerror(errno));
+    auto *dp = fdopendir(dfd);
+    if (!dp) {
         close(dfd);
-        return false;
+        return;
     }
+    /* collect the names first, removing while reading may skip some */
+    std::vector<std::string> names;
+    while (auto *ent = readdir(dp)) {
+        if (!std::strncmp(ent->d_name, ".gc.", 4)) {
+            names.emplace_back(ent->d_name);
+        }
+    }
+    for (auto &nm: names) {
+        struct stat dstat;
+        if (
+            !fstatat(dirfd(dp), nm.data(), &dstat, AT_SYMLINK_NOFOLLOW) &&
+            S_ISDIR(dstat.st_mode)
+        ) {
+            print_dbg("dir_gc: leftover %s/%s", path, nm.data());
+            dir_gc_queue(dirfd(dp), path, nm.data());
+        }
+    }
+    closedir(dp);
+}
 
-    unsigned char buf[offsetof(struct dirent, d_name) + NAME_MAX + 1];
-    unsigned char *bufp = buf;
+static void fd_close_range(unsigned int from, unsigned int to) {
+    if (from > to) {
+        return;
+    }
+#if defined(__linux__) && defined(SYS_close_range)
+    if (!syscall(SYS_close_range, from, to, 0U)) {
+        return;
+    }
+#endif
+    auto maxfd = sysconf(_SC_OPEN_MAX);
+    if (maxfd < 0) {
+        maxfd = 1024;
+    }
+    for (auto i = from; (i <= to) && (long(i) < maxfd); ++i) {
+        close(int(i));
+    }
+}
 
-    struct dirent *dentb = nullptr, *dent = nullptr;
-    std::memcpy(&dentb, &bufp, sizeof(dent));
+void fd_close_except(std::vector<int> keep) {
+    /* syslog reconnects by itself, rather than writing into whatever
+     * happens to get its old descriptor number next
+     */
+    closelog();
+    std::sort(keep.begin(), keep.end());
+    unsigned int from = 3;
+    for (auto fd: keep) {
+        if (fd < int(from)) {
+            continue;
+        }
+        fd_close_range(from, fd - 1);
+        from = fd + 1;
+    }
+    fd_close_range(from, ~0U);
+}
 
+static void dir_gc_loop(int sock) {
+    char buf[PATH_MAX];
     for (;;) {
-        if (readdir_r(d, dentb, &dent) < 0) {
-            print_err("dir_clear: readdir_r failed (%s)", strerror(errno));
-            closedir(d);
-            return false;
-        }
-        if (!dent) {
+        auto ret = recv(sock, buf, sizeof(buf) - 1, 0);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            print_err("dir_gc: recv failed (%s)", strerror(errno));
+            break;
+        } else if (ret == 0) {
+            /* the daemon is gone and everything was processed */
             break;
         }
-        if (
-            !std::strcmp(dent->d_name, ".") ||
-            !std::strcmp(dent->d_name, "..")
-        ) {
+        buf[ret] = '\0';
+        print_dbg("dir_gc: remove %s", buf);
+        int dfd = open(buf, O_RDONLY | O_NOFOLLOW | O_DIRECTORY);
+        if (dfd < 0) {
             continue;
         }
+        if (dir_clear_contents(dfd)) {
+            rmdir(buf);
+        } else {
+            print_dbg("dir_gc: failed to clear contents of %s", buf);
+        }
+    }
+    exit(0);
+}
 
-        print_dbg("dir_clear: clear %s at %d", dent->d_name, dfd);
-        int efd = openat(dfd, dent->d_name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
-        int ufl = 0;
+bool dir_gc_init() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    gc_seq = static_cast<unsigned long long>(ts.tv_sec) * 1000000000ULL;
+    gc_seq += ts.tv_nsec;
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+        print_err("dir_gc: socketpair failed (%s)", strerror(errno));
+        return false;
+    }
+    auto pid = fork();
+    if (pid == 0) {
+        /* reset signals from parent */
+        struct sigaction sa{};
+        sa.sa_handler = SIG_DFL;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGCHLD, &sa, nullptr);
+        sigaction(SIGALRM, &sa, nullptr);
+        sigaction(SIGTERM, &sa, nullptr);
+        sigaction(SIGINT, &sa, nullptr);
+        /* nothing else the daemon has open is any business of ours */
+        fd_close_except({sv[1]});
+        dir_gc_loop(sv[1]);
+    } else if (pid < 0) {
+        print_err("dir_gc: fork failed (%s)", strerror(errno));
+        close(sv[0]);
+        close(sv[1]);
+        return false;
+    }
+    close(sv[1]);
+    gc_sock = sv[0];
+    return true;
+}
 
-        if (efd < 0) {
-            /* this may fail e.g. for invalid sockets, we don't care */
-            goto do_unlink;
-        }
+/* reads a batch of directory entries, which are walked by d_reclen */
+#if defined(__linux__)
+/* the kernel's structure for getdents64, not exposed by all libcs */
+struct dir_ent {
+    std::uint64_t d_ino;
+    std::int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1]; /* actually variable length */
+};
 
-        struct stat st;
-        if (fstat(efd, &st) < 0) {
-            print_err("dir_clear: fstat failed (%s)", strerror(errno));
-            closedir(d);
-            return false;
-        }
+static long dir_read_batch(int fd, char *buf, std::size_t len) {
+    return syscall(SYS_getdents64, fd, buf, len);
+}
+#else
+using dir_ent = struct dirent;
+
+static long dir_read_batch(int fd, char *buf, std::size_t len) {
+    return getdents(fd, buf, len);
+}
+#endif
+
+/* a directory we have descended into; we keep no descriptor for it, only
+ * enough to remove it and to verify it's still the same when coming back
+ */
+struct dir_frame {
+    dev_t dev;
+    ino_t ino;
+    std::string name;
+};
+
+bool dir_clear_contents(int dfd) {
+    if (dfd < 0) {
+        /* silently return if an invalid file descriptor */
+        return false;
+    }
 
-        if (S_ISDIR(st.st_mode)) {
-            if (!dir_clear_contents(efd)) {
-                closedir(d);
-                return false;
+    /* only ever used by one walk at a time */
+    alignas(dir_ent) static char buf[32768];
+
+    std::vector<dir_frame> stack;
+    struct stat st;
+
+    if (fstat(dfd, &st) < 0) {
+        print_err("dir_clear: fstat failed (%s)", strerror(errno));
+        close(dfd);
+        return false;
+    }
+    stack.push_back({st.st_dev, st.st_ino, {}});
+
+    for (;;) {
+        auto nread = dir_read_batch(dfd, buf, sizeof(buf));
+        if (nread < 0) {
+            print_err("dir_clear: getdents failed (%s)", strerror(errno));
+            goto fail;
+        }
+        if (nread == 0) {
+            /* everything in here is gone now */
+            if (stack.size() == 1) {
+                break;
             }
-            ufl = AT_REMOVEDIR;
-        } else {
-            close(efd);
+            /* go back up and make sure we end up where we came from */
+            auto &pfr = stack[stack.size() - 2];
+            int pfd = openat(dfd, "..", O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+            if ((pfd < 0) || (fstat(pfd, &st) < 0)) {
+                print_err("dir_clear: failed to ascend (%s)", strerror(errno));
+                if (pfd >= 0) {
+                    close(pfd);
+                }
+                goto fail;
+            }
+            if ((st.st_dev != pfr.dev) || (st.st_ino != pfr.ino)) {
+                print_err("dir_clear: directory moved during removal");
+                close(pfd);
+                goto fail;
+            }
+            close(dfd);
+            /* fresh descriptor, so we read whatever is left from the start */
+            dfd = pfd;
+            if (unlinkat(dfd, stack.back().name.data(), AT_REMOVEDIR) < 0) {
+                print_err("dir_clear: unlinkat failed (%s)", strerror(errno));
+                goto fail;
+            }
+            stack.pop_back();
+            continue;
         }
+        for (long pos = 0; pos < nread;) {
+            auto *dent = reinterpret_cast<dir_ent *>(buf + pos);
+            pos += dent->d_reclen;
+            char const *name = dent->d_name;
+            if (
+                (name[0] == '.') &&
+                (!name[1] || ((name[1] == '.') && !name[2]))
+            ) {
+                continue;
+            }
 
-do_unlink:
-        if (unlinkat(dfd, dent->d_name, ufl) < 0) {
-            print_err("dir_clear: unlinkat failed (%s)", strerror(errno));
-            closedir(d);
-            return false;
+            print_dbg("dir_clear: clear %s at %d", name, dfd);
+            auto dtype = dent->d_type;
+
+            if (dtype == DT_UNKNOWN) {
+                /* not all filesystems tell us */
+                if (fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+                    if (errno == ENOENT) {
+                        continue;
+                    }
+                    print_err("dir_clear: fstatat failed (%s)", strerror(errno));
+                    goto fail;
+                }
+                dtype = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+            }
+
+            if (dtype == DT_DIR) {
+                int cfd = openat(
+                    dfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW
+                );
+                if (cfd >= 0) {
+                    if (fstat(cfd, &st) < 0) {
+                        print_err(
+                            "dir_clear: fstat failed (%s)", strerror(errno)
+                        );
+                        close(cfd);
+                        goto fail;
+                    }
+                    stack.push_back({st.st_dev, st.st_ino, name});
+                    close(dfd);
+                    /* the rest of this batch is read again when back */
+                    dfd = cfd;
+                    goto next_batch;
+                }
+                /* not a directory anymore, or it's gone, try unlinking */
+            }
+
+            if (unlinkat(dfd, name, 0) < 0) {
+                if (errno == ENOENT) {
+                    continue;
+                }
+                print_err("dir_clear: unlinkat failed (%s)", strerror(errno));
+                goto fail;
+            }
         }
+next_batch:
+        continue;
     }
 
-    closedir(d);
+    close(dfd);
     return true;
+
+fail:
+    close(dfd);
+    return false;
 }
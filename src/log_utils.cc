@@ -0,0 +1,243 @@
+#include <atomic>
+#include <cstdarg>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <paths.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+
+#include "turnstiled.hh"
+
+/* messages are formatted right away, as the arguments are usually gone
+ * as soon as the call returns, and queued in a fixed ring; a separate
+ * thread does the writing to stderr and syslog, which may block when the
+ * log daemon is slow, so that the main loop never has to wait on it
+ *
+ * there is only ever one producer (the main loop) and one consumer (the
+ * flusher), so the ring needs nothing but the two indexes; when it is
+ * full, messages are dropped and the flusher reports how many
+ */
+static constexpr std::size_t log_slots = 256;
+static constexpr std::size_t log_len = 512;
+
+struct log_entry {
+    int prio;
+    bool to_stderr;
+    char msg[log_len];
+};
+
+static log_entry log_ring[log_slots];
+/* next slot to write, only changed by the producer */
+static std::atomic<std::size_t> log_head{0};
+/* next slot to read, only changed by the flusher */
+static std::atomic<std::size_t> log_tail{0};
+static std::atomic<unsigned long> log_dropped{0};
+/* whether the flusher is (about to be) waiting for a wakeup */
+static std::atomic<bool> log_sleeping{false};
+static std::atomic<bool> log_stop{false};
+/* the flusher waits on the read end, the producer writes a byte */
+static int log_pipe[2] = {-1, -1};
+static pthread_t log_thread;
+/* the flusher's own connection to the log daemon */
+static int log_sock = -1;
+/* whether messages go through the flusher, otherwise they are direct */
+static bool log_running = false;
+
+static void log_write(int prio, bool to_stderr, char const *msg) {
+    if (to_stderr) {
+        fprintf(stderr, "%s\n", msg);
+    }
+    syslog(prio, "%s", msg);
+}
+
+/* the flusher does not go through stdio or syslog(), as it would be
+ * holding their locks while blocked on a slow log daemon, and a child
+ * forked meanwhile (which uses both, as do the PAM modules) would find
+ * them held forever; plain writes and our own socket take no locks, so a
+ * fork never has to wait for the flusher
+ */
+static bool log_connect() {
+    if (log_sock < 0) {
+        log_sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (log_sock < 0) {
+            return false;
+        }
+    }
+    sockaddr_un saddr{};
+    saddr.sun_family = AF_UNIX;
+    std::memcpy(saddr.sun_path, _PATH_LOG, sizeof(_PATH_LOG));
+    return (connect(
+        log_sock, reinterpret_cast<sockaddr const *>(&saddr), sizeof(saddr)
+    ) == 0);
+}
+
+static void log_send(int prio, bool to_stderr, char const *msg) {
+    if (to_stderr) {
+        iovec iov[2] = {
+            {const_cast<char *>(msg), std::strlen(msg)},
+            {const_cast<char *>("\n"), 1}
+        };
+        writev(STDERR_FILENO, iov, 2);
+    }
+    /* no timestamp, the log daemon puts in the time it got it */
+    char buf[log_len + 64];
+    int len = std::snprintf(
+        buf, sizeof(buf), "<%d>turnstiled[%ld]: %s",
+        LOG_MAKEPRI(LOG_DAEMON, LOG_PRI(prio)), long(getpid()), msg
+    );
+    if (len < 0) {
+        return;
+    }
+    if (std::size_t(len) >= sizeof(buf)) {
+        len = sizeof(buf) - 1;
+    }
+    /* the log daemon may have been restarted, so reconnect once */
+    for (int i = 0; i < 2; ++i) {
+        if (send(log_sock, buf, std::size_t(len), MSG_NOSIGNAL) >= 0) {
+            return;
+        }
+        if (!log_connect()) {
+            return;
+        }
+    }
+}
+
+static void log_drain() {
+    auto tail = log_tail.load(std::memory_order_relaxed);
+    auto head = log_head.load(std::memory_order_acquire);
+    while (tail != head) {
+        auto &ent = log_ring[tail % log_slots];
+        log_send(ent.prio, ent.to_stderr, ent.msg);
+        log_tail.store(++tail, std::memory_order_release);
+        if (tail == head) {
+            head = log_head.load(std::memory_order_acquire);
+        }
+    }
+    auto lost = log_dropped.exchange(0);
+    if (lost) {
+        char buf[64];
+        std::snprintf(
+            buf, sizeof(buf), "turnstiled: %lu log messages dropped", lost
+        );
+        log_send(LOG_WARNING, false, buf);
+    }
+}
+
+static void *log_flusher(void *) {
+    for (;;) {
+        log_drain();
+        log_sleeping.store(true);
+        /* something may have come in before we said we are sleeping */
+        if (
+            log_tail.load(std::memory_order_relaxed) !=
+            log_head.load(std::memory_order_acquire)
+        ) {
+            log_sleeping.store(false);
+            continue;
+        }
+        if (log_stop.load()) {
+            break;
+        }
+        char c;
+        /* a stale wakeup costs an extra round trip, which is harmless */
+        while ((read(log_pipe[0], &c, 1) < 0) && (errno == EINTR)) {
+            continue;
+        }
+        log_sleeping.store(false);
+    }
+    return nullptr;
+}
+
+static void log_wake() {
+    if (log_sleeping.exchange(false)) {
+        char c = 0;
+        /* never blocks; if the pipe is full, it is awake anyway */
+        write(log_pipe[1], &c, 1);
+    }
+}
+
+/* the child of a fork only gets the calling thread, so it writes directly */
+static void log_fork_child() {
+    log_running = false;
+}
+
+void log_msg(int prio, char const *fmt, ...) {
+    bool to_stderr = cdata && cdata->debug_stderr;
+    va_list ap;
+    if (!log_running) {
+        char buf[log_len];
+        va_start(ap, fmt);
+        std::vsnprintf(buf, sizeof(buf), fmt, ap);
+        va_end(ap);
+        log_write(prio, to_stderr, buf);
+        return;
+    }
+    auto head = log_head.load(std::memory_order_relaxed);
+    if ((head - log_tail.load(std::memory_order_acquire)) >= log_slots) {
+        ++log_dropped;
+        log_wake();
+        return;
+    }
+    auto &ent = log_ring[head % log_slots];
+    ent.prio = prio;
+    ent.to_stderr = to_stderr;
+    va_start(ap, fmt);
+    std::vsnprintf(ent.msg, sizeof(ent.msg), fmt, ap);
+    va_end(ap);
+    log_head.store(head + 1, std::memory_order_release);
+    log_wake();
+}
+
+bool log_init() {
+    static bool registered = false;
+    if (log_running) {
+        return true;
+    }
+    if (log_pipe[0] < 0) {
+        if (pipe2(log_pipe, O_CLOEXEC) < 0) {
+            print_err("log: pipe failed (%s)", strerror(errno));
+            return false;
+        }
+        fcntl(log_pipe[1], F_SETFL, O_NONBLOCK);
+    }
+    /* not fatal, it is retried when sending */
+    if (log_sock < 0) {
+        log_connect();
+    }
+    /* the flusher gets no signals, those are for the main loop */
+    sigset_t mask, omask;
+    sigfillset(&mask);
+    pthread_sigmask(SIG_SETMASK, &mask, &omask);
+    log_stop.store(false);
+    int err = pthread_create(&log_thread, nullptr, log_flusher, nullptr);
+    pthread_sigmask(SIG_SETMASK, &omask, nullptr);
+    if (err) {
+        print_err("log: failed to start flusher (%s)", strerror(err));
+        return false;
+    }
+    if (!registered) {
+        pthread_atfork(nullptr, nullptr, log_fork_child);
+        std::atexit(log_exit);
+        registered = true;
+    }
+    log_running = true;
+    return true;
+}
+
+void log_exit() {
+    if (!log_running) {
+        return;
+    }
+    log_running = false;
+    log_stop.store(true);
+    /* make sure it is not waiting on the pipe forever */
+    char c = 0;
+    write(log_pipe[1], &c, 1);
+    pthread_join(log_thread, nullptr);
+}
@@ -45,6 +45,7 @@ static void free_sock(pam_handle_t *, void *data, int) {
 
 static bool open_session(
     pam_handle_t *pamh,
+    char const *spath,
     unsigned int uid,
     char const *service,
     char const *stype,
@@ -86,8 +87,14 @@ static bool open_session(
     sockaddr_un saddr;
     std::memset(&saddr, 0, sizeof(saddr));
 
+    auto splen = std::strlen(spath);
+    if (splen >= sizeof(saddr.sun_path)) {
+        pam_syslog(pamh, LOG_ERR, "socket path %s too long", spath);
+        return false;
+    }
+
     saddr.sun_family = AF_UNIX;
-    std::memcpy(saddr.sun_path, DAEMON_SOCK, sizeof(DAEMON_SOCK));
+    std::memcpy(saddr.sun_path, spath, splen + 1);
 
     auto send_full = [sock](void const *buf, std::size_t len) -> bool {
         auto *cbuf = static_cast<unsigned char const *>(buf);
@@ -311,7 +318,7 @@ static unsigned long get_x_vtnr(char const *display) {
 
 static void parse_args(
     pam_handle_t *pamh, int argc, char const **argv, bool &debug, bool &sess,
-    char const **cl, char const **dtop, char const **type
+    char const **cl, char const **dtop, char const **type, char const **spath
 ) {
     for (int i = 0; i < argc; ++i) {
         /* is in-session invocation */
@@ -345,6 +352,13 @@ static void parse_args(
             }
             continue;
         }
+        /* alternative daemon socket */
+        if (!std::strncmp(argv[i], "socket=", 7)) {
+            if (spath) {
+                *spath = argv[i] + 7;
+            }
+            continue;
+        }
         /* unknown */
         pam_syslog(pamh, LOG_WARNING, "unknown parameter '%s'", argv[i]);
     }
@@ -370,8 +384,11 @@ extern "C" PAMAPI int pam_sm_open_session(
     char const *pclass = nullptr;
     char const *pdesktop = nullptr;
     char const *ptype = nullptr;
+    char const *spath = DAEMON_SOCK;
     /* parse the args */
-    parse_args(pamh, argc, argv, debug, in_sess, &pclass, &pdesktop, &ptype);
+    parse_args(
+        pamh, argc, argv, debug, in_sess, &pclass, &pdesktop, &ptype, &spath
+    );
 
     /* debug */
     if (debug) {
@@ -548,6 +565,7 @@ extern "C" PAMAPI int pam_sm_open_session(
 
     if (!open_session(
         pamh,
+        spath,
         pwd->pw_uid,
         service,
         xtype,
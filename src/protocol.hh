@@ -43,6 +43,11 @@
  *         is a sequence of null-terminated strings
  * CLIENT: finishes startup, exports each variable in the received env
  *         block and finalizes session
+ *
+ * instead of MSG_START, a client running as root may send MSG_REC_DUMP,
+ * to which the server responds with MSG_OK_DONE once it has written the
+ * event recorder into the "events" file in the socket directory, or with
+ * MSG_ERR if that failed
  */
 
 /* byte-sized message identifiers */
@@ -54,6 +59,8 @@ enum {
     MSG_START,
     /* sent by server on errors */
     MSG_ERR,
+    /* dump the event recorder */
+    MSG_REC_DUMP,
 };
 
 #endif
@@ -0,0 +1,41 @@
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "turnstiled.hh"
+
+/* a pressure stall trigger, which makes the descriptor report POLLPRI
+ * whenever tasks were stalled for at least stall milliseconds within a
+ * window; it reports at most once per window for as long as it lasts
+ */
+int psi_open(char const *path, unsigned long stall, unsigned long window) {
+#if defined(__linux__)
+    int fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        print_err("pressure: failed to open %s (%s)", path, strerror(errno));
+        return -1;
+    }
+    char buf[64];
+    auto len = std::snprintf(
+        buf, sizeof(buf), "some %lu %lu", stall * 1000, window * 1000
+    );
+    /* the terminating zero is a part of the trigger */
+    if (write(fd, buf, len + 1) < 0) {
+        print_err(
+            "pressure: failed to set up trigger on %s (%s)",
+            path, strerror(errno)
+        );
+        close(fd);
+        return -1;
+    }
+    return fd;
+#else
+    (void)stall;
+    (void)window;
+    print_err("pressure: %s is not supported on this system", path);
+    return -1;
+#endif
+}
@@ -0,0 +1,103 @@
+/* the event recorder format, shared by the daemon and the decoder
+ *
+ * Copyright 2022 q66 <q66@chimera-linux.org>
+ * License: BSD-2-Clause
+ */
+
+#ifndef TURNSTILED_REC_EVENTS_HH
+#define TURNSTILED_REC_EVENTS_HH
+
+#include <cstdint>
+
+/* the list of events; codes are assigned in order, so new events may only
+ * ever be appended, or old dumps will be decoded incorrectly
+ */
+#define REC_EVENTS(X) \
+    X(POLL, "poll") \
+    X(SIG_CHLD, "sigchld") \
+    X(SIG_ALRM, "sigalrm") \
+    X(SIG_TERM, "sigterm") \
+    X(SIG_HUP, "sighup") \
+    X(SIG_USR1, "sigusr1") \
+    X(SIG_USR2, "sigusr2") \
+    X(CONN_ACCEPT, "conn_accept") \
+    X(CONN_READ, "conn_read") \
+    X(CONN_HUP, "conn_hup") \
+    X(CONN_CLOSE, "conn_close") \
+    X(CONN_ERROR, "conn_error") \
+    X(MSG_START, "msg_start") \
+    X(MSG_DENIED, "msg_denied") \
+    X(SESS_NEW, "sess_new") \
+    X(SESS_HANDSHAKE, "sess_handshake") \
+    X(SESS_WAIT, "sess_wait") \
+    X(SESS_DONE, "sess_done") \
+    X(SESS_ENV, "sess_env") \
+    X(LOGIN_INIT, "login_init") \
+    X(LOGIN_REPOPULATE, "login_repopulate") \
+    X(LOGIN_DROP, "login_drop") \
+    X(LOGIN_TIMER, "login_timer") \
+    X(SRV_START, "srv_start") \
+    X(SRV_FORK, "srv_fork") \
+    X(SRV_FORK_FAIL, "srv_fork_fail") \
+    X(SRV_PIPE, "srv_pipe") \
+    X(SRV_BOOT, "srv_boot") \
+    X(SRV_READY, "srv_ready") \
+    X(SRV_STOP, "srv_stop") \
+    X(SRV_KILL, "srv_kill") \
+    X(SRV_REAP, "srv_reap") \
+    X(SRV_RESTART, "srv_restart") \
+    X(SRV_FAILED, "srv_failed") \
+    X(DAEMON_RELOAD, "daemon_reload") \
+    X(DAEMON_UPGRADE, "daemon_upgrade") \
+    X(DAEMON_TERM, "daemon_term") \
+    X(DAEMON_DEADLINE, "daemon_deadline") \
+    X(DAEMON_DUMP, "daemon_dump") \
+    X(SIG_IO, "sigio") \
+    X(CG_KILL, "cg_kill") \
+    X(CG_EMPTY, "cg_empty") \
+    X(CG_FREEZE, "cg_freeze") \
+    X(CG_THAW, "cg_thaw") \
+    X(SRV_EVICT, "srv_evict")
+
+enum rec_code {
+#define REC_CODE(code, name) REC_##code,
+    REC_EVENTS(REC_CODE)
+#undef REC_CODE
+    REC_CODES,
+};
+
+/* the dump is a header followed by the records, oldest first; it is
+ * only ever read on the same machine, so everything is native
+ */
+#define REC_MAGIC 0x54535245
+#define REC_VERSION 1
+
+struct rec_header {
+    std::uint32_t magic;
+    std::uint16_t version;
+    /* the size of each record */
+    std::uint16_t rsize;
+    /* the number of records that follow */
+    std::uint32_t count;
+    /* the number of records that were overwritten before the dump */
+    std::uint32_t lost;
+    /* add to a record's time to get the wall clock time */
+    std::int64_t realtime;
+};
+
+/* a single event, fields that do not apply are all ones */
+struct rec_entry {
+    /* monotonic time in nanoseconds */
+    std::uint64_t time;
+    std::uint64_t sid;
+    std::uint32_t uid;
+    std::int32_t pid;
+    std::int32_t fd;
+    /* errno, if any, 0 otherwise */
+    std::int16_t err;
+    std::uint16_t code;
+};
+
+static_assert(sizeof(rec_entry) == 32, "unexpected record size");
+
+#endif
@@ -0,0 +1,88 @@
+#include <cstring>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "turnstiled.hh"
+
+/* the flight recorder is a fixed ring of records that is always on; it
+ * is only ever touched from the main loop (signals go through the pipe),
+ * so recording is just a store into the next slot with no locking, and
+ * once full, the oldest records get overwritten
+ */
+static constexpr std::uint32_t rec_size = 8192;
+static_assert(!(rec_size & (rec_size - 1)), "ring size must be power of 2");
+
+static rec_entry rec_ring[rec_size];
+/* total number of records ever made */
+static std::uint64_t rec_total = 0;
+
+static std::uint64_t rec_time(clockid_t clk) {
+    timespec ts;
+    clock_gettime(clk, &ts);
+    return std::uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+void rec_add(
+    rec_code code, unsigned int uid, unsigned long sid,
+    long pid, int fd, int err
+) {
+    auto &ent = rec_ring[rec_total++ & (rec_size - 1)];
+    ent.time = rec_time(CLOCK_MONOTONIC);
+    ent.sid = sid;
+    ent.uid = uid;
+    ent.pid = std::int32_t(pid);
+    ent.fd = fd;
+    ent.err = std::int16_t(err);
+    ent.code = std::uint16_t(code);
+}
+
+bool rec_dump(int dfd) {
+    rec_add(REC_DAEMON_DUMP);
+    int omask = umask(077);
+    int rfd = openat(dfd, "events.tmp", O_CREAT | O_TRUNC | O_WRONLY, 0600);
+    umask(omask);
+    if (rfd < 0) {
+        print_err("rec: tmpfile failed (%s)", strerror(errno));
+        return false;
+    }
+    auto *rf = fdopen(rfd, "w");
+    if (!rf) {
+        print_err("rec: fdopen failed (%s)", strerror(errno));
+        close(rfd);
+        return false;
+    }
+    rec_header hdr{};
+    hdr.magic = REC_MAGIC;
+    hdr.version = REC_VERSION;
+    hdr.rsize = sizeof(rec_entry);
+    hdr.count = (rec_total < rec_size) ? std::uint32_t(rec_total) : rec_size;
+    hdr.lost = std::uint32_t(rec_total - hdr.count);
+    hdr.realtime = std::int64_t(
+        rec_time(CLOCK_REALTIME) - rec_time(CLOCK_MONOTONIC)
+    );
+    /* the oldest record is the one about to be overwritten next */
+    auto first = std::uint32_t((rec_total - hdr.count) & (rec_size - 1));
+    auto tail = (first + hdr.count > rec_size) ? (rec_size - first) : hdr.count;
+    bool ok = (
+        (std::fwrite(&hdr, sizeof(hdr), 1, rf) == 1) &&
+        (std::fwrite(
+            &rec_ring[first], sizeof(rec_entry), tail, rf
+        ) == tail) &&
+        (std::fwrite(
+            &rec_ring[0], sizeof(rec_entry), hdr.count - tail, rf
+        ) == (hdr.count - tail))
+    );
+    if ((std::fclose(rf) != 0) || !ok) {
+        print_err("rec: write failed (%s)", strerror(errno));
+        unlinkat(dfd, "events.tmp", 0);
+        return false;
+    }
+    if (renameat(dfd, "events.tmp", dfd, "events") < 0) {
+        print_err("rec: renameat failed (%s)", strerror(errno));
+        unlinkat(dfd, "events.tmp", 0);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,364 @@
+#include <cstring>
+#include <cerrno>
+#include <deque>
+
+#include <pwd.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+
+#include "turnstiled.hh"
+
+login::login() {
+    timer_sev.sigev_notify = SIGEV_SIGNAL;
+    timer_sev.sigev_signo = SIGALRM;
+    timer_sev.sigev_value.sival_ptr = this;
+    srvstr.reserve(256);
+}
+
+bool login::arm_timer(std::time_t sec, long nsec) {
+    if (timer_create(CLOCK_MONOTONIC, &timer_sev, &timer) < 0) {
+        print_err("timer: timer_create failed (%s)", strerror(errno));
+        return false;
+    }
+    itimerspec tval{};
+    tval.it_value.tv_sec = sec;
+    tval.it_value.tv_nsec = nsec;
+    if (timer_settime(timer, 0, &tval, nullptr) < 0) {
+        print_err("timer: timer_settime failed (%s)", strerror(errno));
+        timer_delete(timer);
+        return false;
+    }
+    timer_armed = true;
+    return true;
+}
+
+void login::disarm_timer() {
+    if (!timer_armed) {
+        return;
+    }
+    timer_delete(timer);
+    timer_armed = false;
+}
+
+session *get_session(std::deque<login> &logins, int fd) {
+    for (auto &lgn: logins) {
+        for (auto &sess: lgn.sessions) {
+            if (fd == sess.fd) {
+                return &sess;
+            }
+        }
+    }
+    print_dbg("msg: no session for %d", fd);
+    return nullptr;
+}
+
+login *login_populate(
+    std::deque<login> &logins, std::shared_ptr<cfg_data> const &ncfg,
+    unsigned int uid
+) {
+    login *lgn = nullptr;
+    for (auto &lgnr: logins) {
+        if (lgnr.uid == uid) {
+            if (!lgnr.repopulate) {
+                print_dbg("msg: using existing login %u", uid);
+                return &lgnr;
+            }
+            lgn = &lgnr;
+            break;
+        }
+    }
+    auto t_pwd = stats_now();
+    auto *pwd = getpwuid(uid);
+    stats_record(STATS_PWD, t_pwd);
+    if (!pwd) {
+        print_err("msg: failed to get pwd for %u (%s)", uid, strerror(errno));
+        return nullptr;
+    }
+    if (pwd->pw_dir[0] != '/') {
+        print_err(
+            "msg: homedir of %s (%u) is not absolute (%s)", pwd->pw_name,
+            uid, pwd->pw_dir
+        );
+        return nullptr;
+    }
+    if (lgn) {
+        print_dbg("msg: repopulate login %u", pwd->pw_uid);
+        rec_add(REC_LOGIN_REPOPULATE, pwd->pw_uid);
+    } else {
+        print_dbg("msg: init login %u", pwd->pw_uid);
+        rec_add(REC_LOGIN_INIT, pwd->pw_uid);
+        lgn = &logins.emplace_back();
+    }
+    /* fill in initial login details */
+    lgn->cfg = ncfg;
+    lgn->uid = pwd->pw_uid;
+    lgn->gid = pwd->pw_gid;
+    lgn->username = pwd->pw_name;
+    lgn->homedir = pwd->pw_dir;
+    lgn->shell = pwd->pw_shell;
+    lgn->rundir.clear();
+    /* somewhat heuristical */
+    auto &cfg = *lgn->cfg;
+    lgn->rundir.reserve(cfg.rdir_path.size() + 8);
+    cfg_expand_rundir(lgn->rundir, cfg.rdir_path.data(), lgn->uid, lgn->gid);
+    lgn->manage_rdir = cfg.manage_rdir && !lgn->rundir.empty();
+    lgn->repopulate = false;
+    TRACE(populate, lgn->uid, -1, -1, -1);
+    return lgn;
+}
+
+bool write_udata(login const &lgn, int dfd) {
+    char uname[32], tmpname[32];
+    std::snprintf(tmpname, sizeof(tmpname), "%u.tmp", lgn.uid);
+    std::snprintf(uname, sizeof(uname), "%u", lgn.uid);
+    int omask = umask(0);
+    int lgnfd = openat(
+        dfd, tmpname, O_CREAT | O_TRUNC | O_WRONLY, 0644
+    );
+    if (lgnfd < 0) {
+        print_err("msg: user tmpfile failed (%s)", strerror(errno));
+        umask(omask);
+        return false;
+    }
+    umask(omask);
+    auto *lgnf = fdopen(lgnfd, "w");
+    if (!lgnf) {
+        print_err("msg: user fdopen failed (%s)", strerror(errno));
+        close(lgnfd);
+        return false;
+    }
+    std::fprintf(
+        lgnf,
+        "NAME=%s\n"
+        "RUNTIME=%s\n",
+        lgn.username.data(),
+        lgn.rundir.data()
+    );
+    std::fprintf(lgnf, "SESSIONS=");
+    bool first = true;
+    for (auto &s: lgn.sessions) {
+        if (!first) {
+            std::fprintf(lgnf, " ");
+        }
+        std::fprintf(lgnf, "%lu", s.id);
+        first = false;
+    }
+    std::fprintf(lgnf, "\nSEATS=");
+    first = true;
+    for (auto &s: lgn.sessions) {
+        if (!first) {
+            std::fprintf(lgnf, " ");
+        }
+        if (s.s_seat.empty()) {
+            continue;
+        }
+        std::fprintf(lgnf, "%s", s.s_seat.data());
+        first = false;
+    }
+    std::fprintf(lgnf, "\n");
+    std::fprintf(lgnf, "SERVICE_RESTARTS=%u\n", lgn.restart_total);
+    if (lgn.srv_failed) {
+        std::fprintf(lgnf, "SERVICE_FAILED=1\n");
+    }
+    /* done writing */
+    std::fclose(lgnf);
+    /* now rename to real file */
+    if (renameat(dfd, tmpname, dfd, uname) < 0) {
+        print_err("msg: user renameat failed (%s)", strerror(errno));
+        unlinkat(dfd, tmpname, 0);
+        return false;
+    }
+    return true;
+}
+
+bool write_sdata(session const &sess, int sdfd, int udfd) {
+    char sessname[32], tmpname[32];
+    std::snprintf(tmpname, sizeof(tmpname), "%lu.tmp", sess.id);
+    std::snprintf(sessname, sizeof(sessname), "%lu", sess.id);
+    auto &lgn = *sess.lgn;
+    int omask = umask(0);
+    int sessfd = openat(
+        sdfd, tmpname, O_CREAT | O_TRUNC | O_WRONLY, 0644
+    );
+    if (sessfd < 0) {
+        print_err("msg: session tmpfile failed (%s)", strerror(errno));
+        umask(omask);
+        return false;
+    }
+    umask(omask);
+    auto *sessf = fdopen(sessfd, "w");
+    if (!sessf) {
+        print_err("msg: session fdopen failed (%s)", strerror(errno));
+        close(sessfd);
+        return false;
+    }
+    /* now write all the session data */
+    std::fprintf(
+        sessf,
+        "UID=%u\n"
+        "USER=%s\n",
+        lgn.uid,
+        lgn.username.data()
+    );
+    if (sess.vtnr) {
+        std::fprintf(sessf, "IS_DISPLAY=1\n");
+    }
+    std::fprintf(sessf, "REMOTE=%d\n", int(sess.remote));
+    std::fprintf(sessf, "TYPE=%s\n", sess.s_type.data());
+    std::fprintf(sessf, "ORIGINAL_TYPE=%s\n", sess.s_type.data());
+    std::fprintf(sessf, "CLASS=%s\n", sess.s_class.data());
+    if (!sess.s_seat.empty()) {
+        std::fprintf(sessf, "SEAT=%s\n", sess.s_seat.data());
+    }
+    if (!sess.s_tty.empty()) {
+        std::fprintf(sessf, "TTY=%s\n", sess.s_tty.data());
+    }
+    if (!sess.s_service.empty()) {
+        std::fprintf(sessf, "SERVICE=%s\n", sess.s_service.data());
+    }
+    if (sess.vtnr) {
+        std::fprintf(sessf, "VTNR=%lu\n", sess.vtnr);
+    }
+    std::fprintf(sessf, "LEADER=%ld\n", long(sess.lpid));
+    /* done writing */
+    std::fclose(sessf);
+    /* now rename to real file */
+    if (renameat(sdfd, tmpname, sdfd, sessname) < 0) {
+        print_err("msg: session renameat failed (%s)", strerror(errno));
+        unlinkat(sdfd, tmpname, 0);
+        return false;
+    }
+    return write_udata(lgn, udfd);
+}
+
+void drop_udata(login const &lgn, int dfd) {
+    char lgname[64];
+    std::snprintf(lgname, sizeof(lgname), "%u", lgn.uid);
+    unlinkat(dfd, lgname, 0);
+}
+
+void drop_sdata(session const &sess, int dfd) {
+    char sessname[64];
+    std::snprintf(sessname, sizeof(sessname), "%lu", sess.id);
+    unlinkat(dfd, sessname, 0);
+}
+
+bool recv_val(int fd, void *buf, size_t sz) {
+    auto ret = recv(fd, buf, sz, 0);
+    if (ret < 0) {
+        if (errno == EINTR) {
+            return recv_val(fd, buf, sz);
+        }
+        print_err("msg: recv failed (%s)", strerror(errno));
+    }
+    if (size_t(ret) != sz) {
+        print_err("msg: partial recv despite peek");
+        return false;
+    }
+    return true;
+}
+
+static bool recv_str(
+    session &sess, istr &outs, unsigned int minlen, unsigned int maxlen
+) {
+    char buf[1024];
+    if (!sess.str_left) {
+        print_dbg("msg: str start");
+        outs.reset();
+        size_t slen;
+        if (!recv_val(sess.fd, &slen, sizeof(slen))) {
+            return false;
+        }
+        if ((slen < minlen) || (slen > maxlen)) {
+            print_err("msg: invalid string length");
+            return false;
+        }
+        sess.str_left = slen;
+        /* we are awaiting string, which may come in arbitrary chunks */
+        sess.needed = 0;
+        return true;
+    }
+    auto left = sess.str_left;
+    if (left > sizeof(buf)) {
+        left = sizeof(buf);
+    }
+    auto ret = recv(sess.fd, buf, left, 0);
+    if (ret < 0) {
+        if (errno == EINTR) {
+            return recv_str(sess, outs, minlen, maxlen);
+        } else if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+            return true;
+        }
+        print_err("msg: recv failed (%s)", strerror(errno));
+        return false;
+    }
+    sess.str_left -= ret;
+    /* usually the whole string is there at once and goes right into
+     * the pool; one that comes in pieces is put together first
+     */
+    if (!sess.str_left && sess.s_pend.empty()) {
+        outs = std::string_view{buf, std::size_t(ret)};
+        return true;
+    }
+    sess.s_pend.append(buf, ret);
+    if (!sess.str_left) {
+        outs = sess.s_pend;
+        std::string{}.swap(sess.s_pend);
+    }
+    return true;
+}
+
+/* one step of the session handshake, as much as the socket has ready;
+ * once pend_rhost is cleared, the whole handshake has been received
+ */
+bool sess_handshake(session &sess) {
+    if (sess.pend_vtnr) {
+        print_dbg("msg: get session vtnr");
+        if (!recv_val(sess.fd, &sess.vtnr, sizeof(sess.vtnr))) {
+            return false;
+        }
+        /* remote */
+        sess.needed = sizeof(bool);
+        sess.pend_vtnr = 0;
+        return true;
+    }
+    if (sess.pend_remote) {
+        print_dbg("msg: get remote");
+        if (!recv_val(sess.fd, &sess.remote, sizeof(sess.remote))) {
+            return false;
+        }
+        /* service str */
+        sess.needed = sizeof(size_t);
+        sess.pend_remote = 0;
+        return true;
+    }
+#define GET_STR(type, min, max) \
+    if (sess.pend_##type) { \
+        print_dbg("msg: get " #type); \
+        if (!recv_str(sess, sess.s_##type, min, max)) { \
+            return false; \
+        } \
+        if (!sess.str_left) { \
+            sess.pend_##type = false; \
+            /* we are waiting for length of next string */ \
+            sess.needed = sizeof(size_t); \
+            print_dbg("msg: got \"%s\"", sess.s_##type.data()); \
+        } \
+        return true; \
+    }
+    GET_STR(service, 1, 64)
+    GET_STR(type, 1, 16)
+    GET_STR(class, 1, 16)
+    GET_STR(desktop, 0, 64)
+    GET_STR(seat, 0, 32)
+    GET_STR(tty, 0, 16)
+    GET_STR(display, 0, 16)
+    GET_STR(ruser, 0, 256)
+    GET_STR(rhost, 0, 256)
+#undef GET_STR
+    /* should be unreachable */
+    print_dbg("msg: unreachable handshake");
+    return false;
+}
@@ -0,0 +1,424 @@
+#include <cstring>
+#include <cstdint>
+#include <string_view>
+
+#include "turnstiled.hh"
+
+/* the state file is only ever read by the daemon on the same machine,
+ * so values are stored in native representation and the layout is just
+ * the write order; the reader may be a newer build, so anything added
+ * later is only read when the file version says it is there
+ */
+
+bool state_put(std::FILE *f, void const *buf, std::size_t len) {
+    return (std::fwrite(buf, 1, len, f) == len);
+}
+
+bool state_get(std::FILE *f, void *buf, std::size_t len) {
+    return (std::fread(buf, 1, len, f) == len);
+}
+
+template<typename T>
+static bool state_put_val(std::FILE *f, T const &val) {
+    return state_put(f, &val, sizeof(val));
+}
+
+template<typename T>
+static bool state_get_val(std::FILE *f, T &val) {
+    return state_get(f, &val, sizeof(val));
+}
+
+static bool state_put_str(std::FILE *f, std::string const &str) {
+    std::size_t slen = str.size();
+    return state_put_val(f, slen) && state_put(f, str.data(), slen);
+}
+
+static bool state_get_str(std::FILE *f, std::string &str) {
+    std::size_t slen;
+    if (!state_get_val(f, slen) || (slen > 65536)) {
+        return false;
+    }
+    str.resize(slen);
+    return state_get(f, str.data(), slen);
+}
+
+/* the strings of a session, in the order they are received and stored */
+static istr session::*const sess_strs[] = {
+    &session::s_service,
+    &session::s_type,
+    &session::s_class,
+    &session::s_desktop,
+    &session::s_seat,
+    &session::s_tty,
+    &session::s_display,
+    &session::s_ruser,
+    &session::s_rhost,
+};
+
+static constexpr std::size_t sess_nstrs =
+    sizeof(sess_strs) / sizeof(*sess_strs);
+
+/* the string that has only partially come in, which is stored in its
+ * place so that the layout is the same as when it was a plain string
+ */
+static std::size_t sess_partial(session const &sess) {
+    if (!sess.str_left) {
+        return sess_nstrs;
+    }
+    unsigned int const pend[] = {
+        sess.pend_service, sess.pend_type, sess.pend_class,
+        sess.pend_desktop, sess.pend_seat, sess.pend_tty,
+        sess.pend_display, sess.pend_ruser, sess.pend_rhost,
+    };
+    static_assert((sizeof(pend) / sizeof(*pend)) == sess_nstrs);
+    for (std::size_t i = 0; i < sess_nstrs; ++i) {
+        if (pend[i]) {
+            return i;
+        }
+    }
+    return sess_nstrs;
+}
+
+/* session flags, the handshake state is kept in bitfields */
+enum {
+    SESS_HANDSHAKE = 1 << 0,
+    SESS_VTNR = 1 << 1,
+    SESS_REMOTE = 1 << 2,
+    SESS_SERVICE = 1 << 3,
+    SESS_TYPE = 1 << 4,
+    SESS_CLASS = 1 << 5,
+    SESS_DESKTOP = 1 << 6,
+    SESS_SEAT = 1 << 7,
+    SESS_TTY = 1 << 8,
+    SESS_DISPLAY = 1 << 9,
+    SESS_RUSER = 1 << 10,
+    SESS_RHOST = 1 << 11,
+};
+
+/* login flags */
+enum {
+    LGN_REPOPULATE = 1 << 0,
+    LGN_SRV_WAIT = 1 << 1,
+    LGN_SRV_PENDING = 1 << 2,
+    LGN_MANAGE_RDIR = 1 << 3,
+    LGN_TIMER_ARMED = 1 << 4,
+    LGN_KILL_TRIED = 1 << 5,
+    LGN_SRV_RESTART = 1 << 6,
+    LGN_SRV_FAILED = 1 << 7,
+    LGN_SRV_FREEZE = 1 << 8,
+    LGN_FROZEN = 1 << 9,
+};
+
+static bool state_put_session(std::FILE *f, session const &sess) {
+    std::uint32_t flags = 0;
+#define SESS_FLAG(fl, field) if (sess.field) flags |= fl;
+    SESS_FLAG(SESS_HANDSHAKE, handshake)
+    SESS_FLAG(SESS_VTNR, pend_vtnr)
+    SESS_FLAG(SESS_REMOTE, pend_remote)
+    SESS_FLAG(SESS_SERVICE, pend_service)
+    SESS_FLAG(SESS_TYPE, pend_type)
+    SESS_FLAG(SESS_CLASS, pend_class)
+    SESS_FLAG(SESS_DESKTOP, pend_desktop)
+    SESS_FLAG(SESS_SEAT, pend_seat)
+    SESS_FLAG(SESS_TTY, pend_tty)
+    SESS_FLAG(SESS_DISPLAY, pend_display)
+    SESS_FLAG(SESS_RUSER, pend_ruser)
+    SESS_FLAG(SESS_RHOST, pend_rhost)
+#undef SESS_FLAG
+    std::uint32_t str_left = sess.str_left;
+    auto partial = sess_partial(sess);
+    for (std::size_t i = 0; i < sess_nstrs; ++i) {
+        auto &str = sess.*sess_strs[i];
+        std::string_view sv{str.data(), str.size()};
+        if (i == partial) {
+            sv = sess.s_pend;
+        }
+        std::size_t slen = sv.size();
+        if (!state_put_val(f, slen) || !state_put(f, sv.data(), slen)) {
+            return false;
+        }
+    }
+    return (
+        state_put_val(f, sess.id) &&
+        state_put_val(f, sess.vtnr) &&
+        state_put_val(f, sess.lpid) &&
+        state_put_val(f, sess.needed) &&
+        state_put_val(f, sess.remote) &&
+        state_put_val(f, sess.fd) &&
+        state_put_val(f, str_left) &&
+        state_put_val(f, flags)
+    );
+}
+
+static bool state_get_session(std::FILE *f, session &sess) {
+    std::uint32_t flags, str_left;
+    std::string strs[sess_nstrs];
+    for (auto &str: strs) {
+        if (!state_get_str(f, str)) {
+            return false;
+        }
+    }
+    if (!(
+        state_get_val(f, sess.id) &&
+        state_get_val(f, sess.vtnr) &&
+        state_get_val(f, sess.lpid) &&
+        state_get_val(f, sess.needed) &&
+        state_get_val(f, sess.remote) &&
+        state_get_val(f, sess.fd) &&
+        state_get_val(f, str_left) &&
+        state_get_val(f, flags)
+    )) {
+        return false;
+    }
+    sess.str_left = str_left;
+#define SESS_FLAG(fl, field) sess.field = !!(flags & fl);
+    SESS_FLAG(SESS_HANDSHAKE, handshake)
+    SESS_FLAG(SESS_VTNR, pend_vtnr)
+    SESS_FLAG(SESS_REMOTE, pend_remote)
+    SESS_FLAG(SESS_SERVICE, pend_service)
+    SESS_FLAG(SESS_TYPE, pend_type)
+    SESS_FLAG(SESS_CLASS, pend_class)
+    SESS_FLAG(SESS_DESKTOP, pend_desktop)
+    SESS_FLAG(SESS_SEAT, pend_seat)
+    SESS_FLAG(SESS_TTY, pend_tty)
+    SESS_FLAG(SESS_DISPLAY, pend_display)
+    SESS_FLAG(SESS_RUSER, pend_ruser)
+    SESS_FLAG(SESS_RHOST, pend_rhost)
+#undef SESS_FLAG
+    auto partial = sess_partial(sess);
+    for (std::size_t i = 0; i < sess_nstrs; ++i) {
+        if (i == partial) {
+            sess.s_pend = std::move(strs[i]);
+        } else {
+            sess.*sess_strs[i] = strs[i];
+        }
+    }
+    return true;
+}
+
+bool state_put_login(std::FILE *f, login const &lgn, timespec const &left) {
+    std::uint32_t flags = 0;
+#define LGN_FLAG(fl, cond) if (cond) flags |= fl;
+    LGN_FLAG(LGN_REPOPULATE, lgn.repopulate)
+    LGN_FLAG(LGN_SRV_WAIT, lgn.srv_wait)
+    LGN_FLAG(LGN_SRV_PENDING, lgn.srv_pending)
+    LGN_FLAG(LGN_MANAGE_RDIR, lgn.manage_rdir)
+    LGN_FLAG(LGN_TIMER_ARMED, lgn.timer_armed)
+    LGN_FLAG(LGN_KILL_TRIED, lgn.kill_tried)
+    LGN_FLAG(LGN_SRV_RESTART, lgn.srv_restart)
+    LGN_FLAG(LGN_SRV_FAILED, lgn.srv_failed)
+    LGN_FLAG(LGN_SRV_FREEZE, lgn.srv_freeze)
+    LGN_FLAG(LGN_FROZEN, lgn.frozen)
+#undef LGN_FLAG
+    std::size_t nsess = lgn.sessions.size();
+    if (!(
+        state_put_str(f, lgn.username) &&
+        state_put_str(f, lgn.srvstr) &&
+        state_put_str(f, lgn.shell) &&
+        state_put_str(f, lgn.homedir) &&
+        state_put_str(f, lgn.rundir) &&
+        state_put_val(f, lgn.srv_pid) &&
+        state_put_val(f, lgn.start_pid) &&
+        state_put_val(f, lgn.term_pid) &&
+        state_put_val(f, lgn.uid) &&
+        state_put_val(f, lgn.gid) &&
+        state_put_val(f, lgn.userpipe) &&
+        state_put_val(f, lgn.dirfd) &&
+        state_put_val(f, left) &&
+        state_put_val(f, flags) &&
+        state_put_val(f, lgn.restart_stamp) &&
+        state_put_val(f, lgn.restart_count) &&
+        state_put_val(f, lgn.restart_total) &&
+        state_put_val(f, lgn.t_idle) &&
+        state_put_val(f, nsess)
+    )) {
+        return false;
+    }
+    for (auto &sess: lgn.sessions) {
+        if (!state_put_session(f, sess)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool state_get_login(
+    std::FILE *f, login &lgn, timespec &left, unsigned int version
+) {
+    std::uint32_t flags;
+    std::size_t nsess;
+    if (!(
+        state_get_str(f, lgn.username) &&
+        state_get_str(f, lgn.srvstr) &&
+        state_get_str(f, lgn.shell) &&
+        state_get_str(f, lgn.homedir) &&
+        state_get_str(f, lgn.rundir) &&
+        state_get_val(f, lgn.srv_pid) &&
+        state_get_val(f, lgn.start_pid) &&
+        state_get_val(f, lgn.term_pid) &&
+        state_get_val(f, lgn.uid) &&
+        state_get_val(f, lgn.gid) &&
+        state_get_val(f, lgn.userpipe) &&
+        state_get_val(f, lgn.dirfd) &&
+        state_get_val(f, left) &&
+        state_get_val(f, flags)
+    )) {
+        return false;
+    }
+    /* restart tracking, added in version 2 */
+    if ((version >= 2) && !(
+        state_get_val(f, lgn.restart_stamp) &&
+        state_get_val(f, lgn.restart_count) &&
+        state_get_val(f, lgn.restart_total)
+    )) {
+        return false;
+    }
+    /* for evicting the longest idle first, added in version 4 */
+    if ((version >= 4) && !state_get_val(f, lgn.t_idle)) {
+        return false;
+    }
+    if (!state_get_val(f, nsess) || (nsess > 65536)) {
+        return false;
+    }
+    lgn.repopulate = !!(flags & LGN_REPOPULATE);
+    lgn.srv_wait = !!(flags & LGN_SRV_WAIT);
+    lgn.srv_pending = !!(flags & LGN_SRV_PENDING);
+    lgn.srv_restart = !!(flags & LGN_SRV_RESTART);
+    lgn.srv_failed = !!(flags & LGN_SRV_FAILED);
+    lgn.srv_freeze = !!(flags & LGN_SRV_FREEZE);
+    lgn.frozen = !!(flags & LGN_FROZEN);
+    lgn.manage_rdir = !!(flags & LGN_MANAGE_RDIR);
+    /* the timer itself is gone, it is up to the caller to re-create it */
+    lgn.timer_armed = false;
+    if (!(flags & LGN_TIMER_ARMED)) {
+        left.tv_sec = -1;
+    }
+    lgn.kill_tried = !!(flags & LGN_KILL_TRIED);
+    lgn.sessions.reserve(nsess);
+    for (std::size_t i = 0; i < nsess; ++i) {
+        auto &sess = lgn.sessions.emplace_back();
+        if (!state_get_session(f, sess)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* every setting of a configuration in the order it is stored, one list
+ * for both directions so that they cannot get out of step
+ */
+template<typename C, typename F>
+static bool cfg_profile_fields(C &prof, F &&fn) {
+    return (
+        fn(prof.name) && fn(prof.rlimits) && fn(prof.cpus) &&
+        fn(prof.memory_high) && fn(prof.cpu_weight) && fn(prof.numa_node) &&
+        fn(prof.sched) && fn(prof.ioprio) && fn(prof.nice) &&
+        fn(prof.set_nice)
+    );
+}
+
+template<typename C, typename F>
+static bool cfg_fields(C &cfg, F &&fn) {
+    return (
+        fn(cfg.login_timeout) && fn(cfg.shutdown_timeout) &&
+        fn(cfg.restart_limit) && fn(cfg.restart_interval) &&
+        fn(cfg.stats_interval) && fn(cfg.freeze_timeout) &&
+        fn(cfg.pressure_stall) && fn(cfg.pressure_window) &&
+        fn(cfg.rundir_inodes) && fn(cfg.debug) && fn(cfg.disable) &&
+        fn(cfg.debug_stderr) && fn(cfg.manage_rdir) && fn(cfg.export_dbus) &&
+        fn(cfg.linger) && fn(cfg.linger_never) && fn(cfg.root_session) &&
+        fn(cfg.ready_fd) && fn(cfg.unprivileged) && fn(cfg.capture_anon) &&
+        fn(cfg.backend) && fn(cfg.rdir_path) && fn(cfg.rdir_size) &&
+        fn(cfg.capture_path) && fn(cfg.pressure_path) && fn(cfg.profiles) &&
+        fn(cfg.profile_users) && fn(cfg.profile_classes) &&
+        fn(cfg.cgroup_path) && fn(cfg.base_path) && fn(cfg.linger_path) &&
+        fn(cfg.state_path) && fn(cfg.backend_path) &&
+        fn(cfg.backend_conf_path)
+    );
+}
+
+template<typename T>
+static bool state_put_item(std::FILE *f, T const &val) {
+    return state_put_val(f, val);
+}
+
+template<typename T>
+static bool state_get_item(std::FILE *f, T &val) {
+    return state_get_val(f, val);
+}
+
+static bool state_put_item(std::FILE *f, std::string const &str) {
+    return state_put_str(f, str);
+}
+
+static bool state_get_item(std::FILE *f, std::string &str) {
+    return state_get_str(f, str);
+}
+
+static bool state_put_item(
+    std::FILE *f, std::pair<std::string, std::string> const &val
+) {
+    return state_put_str(f, val.first) && state_put_str(f, val.second);
+}
+
+static bool state_get_item(
+    std::FILE *f, std::pair<std::string, std::string> &val
+) {
+    return state_get_str(f, val.first) && state_get_str(f, val.second);
+}
+
+static bool state_put_item(std::FILE *f, cfg_profile const &prof);
+static bool state_get_item(std::FILE *f, cfg_profile &prof);
+
+template<typename T>
+static bool state_put_item(std::FILE *f, std::vector<T> const &vec) {
+    std::size_t nvec = vec.size();
+    if (!state_put_val(f, nvec)) {
+        return false;
+    }
+    for (auto &val: vec) {
+        if (!state_put_item(f, val)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+template<typename T>
+static bool state_get_item(std::FILE *f, std::vector<T> &vec) {
+    std::size_t nvec;
+    if (!state_get_val(f, nvec) || (nvec > 65536)) {
+        return false;
+    }
+    vec.resize(nvec);
+    for (auto &val: vec) {
+        if (!state_get_item(f, val)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool state_put_item(std::FILE *f, cfg_profile const &prof) {
+    return cfg_profile_fields(prof, [f](auto const &val) {
+        return state_put_item(f, val);
+    });
+}
+
+static bool state_get_item(std::FILE *f, cfg_profile &prof) {
+    return cfg_profile_fields(prof, [f](auto &val) {
+        return state_get_item(f, val);
+    });
+}
+
+bool state_put_cfg(std::FILE *f, cfg_data const &cfg) {
+    return cfg_fields(cfg, [f](auto const &val) {
+        return state_put_item(f, val);
+    });
+}
+
+bool state_get_cfg(std::FILE *f, cfg_data &cfg) {
+    return cfg_fields(cfg, [f](auto &val) {
+        return state_get_item(f, val);
+    });
+}
@@ -0,0 +1,165 @@
+#include <cmath>
+#include <cstring>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "turnstiled.hh"
+
+/* latencies are kept in log-linear histograms of microseconds; values
+ * below the first power of two that has all sub-buckets are exact, then
+ * every power of two is split into that many linear sub-buckets, so the
+ * error of any quantile is bounded by the sub-bucket width (12.5%)
+ */
+static constexpr unsigned int hist_sub_bits = 3;
+static constexpr unsigned int hist_sub = 1 << hist_sub_bits;
+/* up to 2^64 microseconds, which is more than enough */
+static constexpr unsigned int hist_buckets =
+    (64 - hist_sub_bits + 1) * hist_sub;
+
+struct stats_hist {
+    std::uint64_t buckets[hist_buckets];
+    std::uint64_t count;
+    std::uint64_t max;
+};
+
+static stats_hist hists[STATS_PHASES];
+static std::uint64_t counters[STATS_COUNTERS];
+
+static char const *phase_names[STATS_PHASES] = {
+    "handshake",
+    "getpwuid",
+    "fork",
+    "run",
+    "ready",
+    "env",
+    "login",
+};
+
+static char const *counter_names[STATS_COUNTERS] = {
+    "logins",
+    "starts",
+    "restarts",
+    "failures",
+    "timeouts",
+    "kills",
+    "errors",
+    "evictions",
+};
+
+static unsigned int hist_index(std::uint64_t val) {
+    if (val < hist_sub) {
+        return (unsigned int)val;
+    }
+    /* the position of the highest bit, at least hist_sub_bits */
+    unsigned int msb = 63 - __builtin_clzll(val);
+    unsigned int sub = (val >> (msb - hist_sub_bits)) & (hist_sub - 1);
+    return (msb - hist_sub_bits + 1) * hist_sub + sub;
+}
+
+/* the upper bound of values that fall into the bucket */
+static std::uint64_t hist_value(unsigned int idx) {
+    if (idx < hist_sub) {
+        return idx;
+    }
+    unsigned int msb = idx / hist_sub + hist_sub_bits - 1;
+    std::uint64_t sub = idx % hist_sub;
+    std::uint64_t base = std::uint64_t(1) << msb;
+    return base + ((sub + 1) << (msb - hist_sub_bits)) - 1;
+}
+
+static std::uint64_t hist_quantile(stats_hist const &h, double q) {
+    if (!h.count) {
+        return 0;
+    }
+    /* the rank of the value we want, 1-based */
+    auto rank = std::uint64_t(std::ceil(q * double(h.count)));
+    if (rank < 1) {
+        rank = 1;
+    }
+    std::uint64_t seen = 0;
+    for (unsigned int i = 0; i < hist_buckets; ++i) {
+        seen += h.buckets[i];
+        if (seen >= rank) {
+            auto val = hist_value(i);
+            /* never report more than we have actually seen */
+            return (val > h.max) ? h.max : val;
+        }
+    }
+    return h.max;
+}
+
+std::uint64_t stats_now() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return std::uint64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+void stats_record(stats_phase phase, std::uint64_t since) {
+    if (!since) {
+        /* never started */
+        return;
+    }
+    auto now = stats_now();
+    auto val = (now > since) ? (now - since) : 0;
+    auto &h = hists[phase];
+    ++h.buckets[hist_index(val)];
+    ++h.count;
+    if (val > h.max) {
+        h.max = val;
+    }
+}
+
+void stats_count(stats_counter counter) {
+    ++counters[counter];
+}
+
+bool stats_write(int dfd) {
+    int omask = umask(0);
+    int sfd = openat(dfd, "stats.tmp", O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    umask(omask);
+    if (sfd < 0) {
+        print_err("stats: tmpfile failed (%s)", strerror(errno));
+        return false;
+    }
+    auto *sf = fdopen(sfd, "w");
+    if (!sf) {
+        print_err("stats: fdopen failed (%s)", strerror(errno));
+        close(sfd);
+        return false;
+    }
+    for (int i = 0; i < STATS_COUNTERS; ++i) {
+        std::fprintf(
+            sf, "%s=%llu\n", counter_names[i], (unsigned long long)counters[i]
+        );
+    }
+    /* all latencies in microseconds */
+    for (int i = 0; i < STATS_PHASES; ++i) {
+        auto &h = hists[i];
+        std::fprintf(
+            sf,
+            "%s_count=%llu\n"
+            "%s_p50=%llu\n"
+            "%s_p99=%llu\n"
+            "%s_p999=%llu\n"
+            "%s_max=%llu\n",
+            phase_names[i], (unsigned long long)h.count,
+            phase_names[i], (unsigned long long)hist_quantile(h, 0.5),
+            phase_names[i], (unsigned long long)hist_quantile(h, 0.99),
+            phase_names[i], (unsigned long long)hist_quantile(h, 0.999),
+            phase_names[i], (unsigned long long)h.max
+        );
+    }
+    if (std::fclose(sf) != 0) {
+        print_err("stats: write failed (%s)", strerror(errno));
+        unlinkat(dfd, "stats.tmp", 0);
+        return false;
+    }
+    if (renameat(dfd, "stats.tmp", dfd, "stats") < 0) {
+        print_err("stats: renameat failed (%s)", strerror(errno));
+        unlinkat(dfd, "stats.tmp", 0);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,63 @@
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <string_view>
+#include <unordered_map>
+
+#include "turnstiled.hh"
+
+using str_map = std::unordered_map<std::string_view, istr::entry *>;
+
+/* the keys point into the entries themselves, so looking up a string that
+ * is already there does not allocate anything; the pool is never destroyed,
+ * as sessions may still drop their strings during exit
+ */
+static str_map &str_pool() {
+    static auto *pool = new str_map{};
+    return *pool;
+}
+
+istr &istr::operator=(std::string_view str) {
+    if (str.empty()) {
+        reset();
+        return *this;
+    }
+    if (ent && (std::string_view{ent->str, ent->len} == str)) {
+        return *this;
+    }
+    auto &pool = str_pool();
+    auto it = pool.find(str);
+    if (it != pool.end()) {
+        ++it->second->refs;
+        reset();
+        ent = it->second;
+        return *this;
+    }
+    auto *nent = static_cast<entry *>(
+        ::operator new(offsetof(entry, str) + str.size() + 1)
+    );
+    nent->refs = 1;
+    nent->len = str.size();
+    std::memcpy(nent->str, str.data(), str.size());
+    nent->str[str.size()] = '\0';
+    try {
+        pool.emplace(std::string_view{nent->str, nent->len}, nent);
+    } catch (...) {
+        ::operator delete(nent);
+        throw;
+    }
+    reset();
+    ent = nent;
+    return *this;
+}
+
+void istr::reset() {
+    if (!ent) {
+        return;
+    }
+    if (!--ent->refs) {
+        str_pool().erase(std::string_view{ent->str, ent->len});
+        ::operator delete(ent);
+    }
+    ent = nullptr;
+}
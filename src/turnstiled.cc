@@ -17,7 +17,10 @@
 #include <cassert>
 #include <climits>
 #include <cctype>
+#include <cstdint>
 #include <algorithm>
+#include <deque>
+#include <random>
 #include <new>
 
 #include <pwd.h>
@@ -37,6 +40,10 @@
 #error "No CONF_PATH is defined"
 #endif
 
+#ifndef DAEMON_PATH
+#error "No DAEMON_PATH is defined"
+#endif
+
 /* we accept connections from non-root
  *
  * this relies on non-portable credentials checking,
@@ -48,14 +55,46 @@
 
 #define DEFAULT_CFG_PATH CONF_PATH "/turnstiled.conf"
 
+/* the state handed over to a re-executed daemon (in the state path), and
+ * the environment variable that tells the new image to pick it up
+ */
+#define UPGRADE_STATE "upgrade.state"
+#define UPGRADE_ENV "TURNSTILED_UPGRADE"
+
+/* identifies the state file format, bump when it changes */
+static constexpr std::uint32_t upgrade_magic = 0x54535355;
+static constexpr std::uint32_t upgrade_version = 5;
+
 /* when stopping service manager, we first do a SIGTERM and set up this
  * timeout, if it fails to quit within that period, we issue a SIGKILL
  * and try this timeout again, after that it is considered unrecoverable
  */
 static constexpr std::time_t kill_timeout = 60;
 
-/* global */
-cfg_data *cdata = nullptr;
+/* when shutting down, all service managers are stopped at once and get
+ * shutdown_timeout seconds in total; whatever is left is then killed and
+ * has this much time to actually go away before we give up
+ */
+static constexpr std::time_t kill_grace = 5;
+
+/* a service manager that crashes after having been ready is restarted
+ * after a delay, which starts at the minimum and doubles with every
+ * restart within the restart window, up to the maximum (milliseconds)
+ */
+static constexpr long restart_delay_min = 250;
+static constexpr long restart_delay_max = 30000;
+
+/* owns the current configuration, logins hold on to the one they use */
+static std::shared_ptr<cfg_data> cfg_cur;
+/* where the configuration is read from */
+static char const *cfg_path = DEFAULT_CFG_PATH;
+/* settings given on the command line, applied over the configuration */
+static std::vector<char *> cfg_overrides;
+
+/* the socket directory and the upgrade state, from the startup config */
+static std::string base_dir;
+static std::string state_file;
+static std::string state_tmp;
 
 /* the file descriptor for the base directory */
 static int dirfd_base = -1;
@@ -64,56 +103,28 @@ static int dirfd_users = -1;
 /* the file descriptor for the sessions directory */
 static int dirfd_sessions = -1;
 
-static bool write_udata(login const &lgn);
-static bool write_sdata(session const &sess);
-static void drop_udata(login const &lgn);
-static void drop_sdata(session const &sess);
-
-login::login() {
-    timer_sev.sigev_notify = SIGEV_SIGNAL;
-    timer_sev.sigev_signo = SIGALRM;
-    timer_sev.sigev_value.sival_ptr = this;
-    srvstr.reserve(256);
-}
-
 void login::remove_sdir() {
     char buf[32];
     std::snprintf(buf, sizeof(buf), "%u", this->uid);
-    unlinkat(dirfd_base, buf, AT_REMOVEDIR);
-    /* just in case, we know this is a named pipe */
-    unlinkat(this->dirfd, "ready", 0);
-    dir_clear_contents(this->dirfd);
-    this->dirfd = -1;
-}
-
-bool login::arm_timer(std::time_t timeout) {
-    if (timer_create(CLOCK_MONOTONIC, &timer_sev, &timer) < 0) {
-        print_err("timer: timer_create failed (%s)", strerror(errno));
-        return false;
-    }
-    itimerspec tval{};
-    tval.it_value.tv_sec = timeout;
-    if (timer_settime(timer, 0, &tval, nullptr) < 0) {
-        print_err("timer: timer_settime failed (%s)", strerror(errno));
-        timer_delete(timer);
-        return false;
+    if (this->dirfd >= 0) {
+        close(this->dirfd);
+        this->dirfd = -1;
     }
-    timer_armed = true;
-    return true;
-}
-
-void login::disarm_timer() {
-    if (!timer_armed) {
-        return;
-    }
-    timer_delete(timer);
-    timer_armed = false;
+    /* this gets out of the way immediately, so it can be remade */
+    dir_remove_async(dirfd_base, base_dir.data(), buf);
 }
 
-static std::vector<login> logins;
+/* sessions and timers point at their login, so these must never move;
+ * a deque does not move its elements when appended to
+ */
+static std::deque<login> logins;
 
-/* file descriptors for poll */
+/* file descriptors for poll; the signal pipe, the control socket and the
+ * memory pressure trigger (which may be -1) are always first, followed by
+ * the readiness pipes and then the connections
+ */
 static std::vector<pollfd> fds;
+static constexpr std::size_t nfixed = 3;
 /* connections pending a session */
 static std::vector<int> pending_sess;
 /* number of pipes we are polling on */
@@ -127,14 +138,138 @@ static int sigpipe[2] = {-1, -1};
  * are unique even across logins
  */
 static unsigned long idbase = 0;
+/* the arguments we were started with, for re-execution */
+static char **main_argv = nullptr;
+/* the binary we were started from, for re-execution */
+static std::string exe_path;
+/* for restart delay jitter, so that crashing logins spread out */
+static std::minstd_rand jitter_rng;
+/* set when an upgrade was requested and has not happened yet */
+static bool upgrade = false;
+/* set once we are shutting down */
+static bool term = false;
+/* the shutdown deadline; its address identifies its alarms */
+static timer_t term_timer;
+static bool term_timer_armed = false;
+/* whether the deadline has passed and everything got killed */
+static bool term_killed = false;
+/* periodically rewrites the stats file */
+static timer_t stats_timer;
+static bool stats_timer_armed = false;
+
+static bool send_msg(int fd, unsigned char msg);
+
+/* a lingering login that is left without sessions gets its service
+ * manager frozen after a while, if enabled; nothing else needs the
+ * login timer once the service manager is up
+ */
+static void login_idle(login &lgn) {
+    auto &cfg = *lgn.cfg;
+    if (
+        (cfg.freeze_timeout <= 0) || (lgn.cg_wd < 0) || lgn.frozen ||
+        lgn.srv_wait || (lgn.srv_pid == -1) || lgn.timer_armed ||
+        !lgn.sessions.empty()
+    ) {
+        return;
+    }
+    print_dbg("srv: freeze %u in %ld s", lgn.uid, long(cfg.freeze_timeout));
+    lgn.srv_freeze = lgn.arm_timer(cfg.freeze_timeout);
+}
+
+/* thaw the service manager, or keep it from being frozen */
+static void login_thaw(login &lgn) {
+    if (lgn.srv_freeze) {
+        lgn.disarm_timer();
+        lgn.srv_freeze = false;
+    }
+    if (!lgn.frozen) {
+        return;
+    }
+    print_dbg("srv: thaw %u", lgn.uid);
+    if (cg_freeze(lgn, false)) {
+        rec_add(REC_CG_THAW, lgn.uid);
+    }
+    lgn.frozen = false;
+}
+
+/* notify all sessions of the login that it is fully up; the ones still
+ * in the handshake get told once they finish it
+ */
+static void srv_ready(login &lgn) {
+    for (auto &sess: lgn.sessions) {
+        if (sess.handshake) {
+            continue;
+        }
+        send_msg(sess.fd, MSG_OK_DONE);
+        rec_add(REC_SESS_DONE, lgn.uid, sess.id, sess.lpid, sess.fd);
+        TRACE(ok_done, lgn.uid, sess.id, sess.lpid, sess.fd);
+        stats_record(STATS_LOGIN, sess.t_begin);
+        sess.t_begin = 0;
+    }
+    /* disarm an associated timer */
+    print_dbg("srv: disarm timer");
+    lgn.disarm_timer();
+    lgn.start_pid = -1;
+    lgn.srv_wait = false;
+    /* everybody may have left while it was starting */
+    login_idle(lgn);
+}
+
+/* there is no service manager to run, so there is nothing to fork or wait
+ * for; take care of the rundir right here and mark the login as ready
+ */
+static bool srv_start_none(login &lgn) {
+    print_dbg("srv: no backend for %u, start in-process", lgn.uid);
+    if (lgn.manage_rdir) {
+        print_dbg("srv: setup rundir for %u", lgn.uid);
+        if (!rundir_make(lgn.rundir.data(), lgn.uid, lgn.gid, *lgn.cfg)) {
+            return false;
+        }
+    }
+    lgn.srv_pending = false;
+    srv_ready(lgn);
+    return true;
+}
+
+/* undo what srv_start has set up when the service manager cannot be
+ * launched after all; readyfd is the write end that is still ours
+ */
+static void srv_start_undo(login &lgn, int readyfd) {
+    lgn.disarm_timer();
+    if (readyfd >= 0) {
+        close(readyfd);
+    }
+    if (lgn.userpipe >= 0) {
+        close(lgn.userpipe);
+        lgn.userpipe = -1;
+    }
+    if (lgn.dirfd >= 0) {
+        unlinkat(lgn.dirfd, "ready", 0);
+    }
+    lgn.remove_sdir();
+}
 
 /* start the service manager instance for a login */
 static bool srv_start(login &lgn) {
+    auto t_start = stats_now();
+    stats_count(STATS_STARTS);
+    rec_add(REC_SRV_START, lgn.uid);
     /* prepare some strings */
     char uidbuf[32];
     std::snprintf(uidbuf, sizeof(uidbuf), "%u", lgn.uid);
     /* mark as waiting */
     lgn.srv_wait = true;
+    if (lgn.srv_failed) {
+        /* it was given up on, but somebody logged in again */
+        lgn.srv_failed = false;
+        lgn.restart_count = 0;
+        write_udata(lgn, dirfd_users);
+    }
+    /* without a backend, we don't need any of the machinery below */
+    auto &cfg = *lgn.cfg;
+    if (cfg.disable || ((lgn.uid == 0) && !cfg.root_session)) {
+        return srv_start_none(lgn);
+    }
     /* set up login dir */
     print_dbg("srv: create login dir for %u", lgn.uid);
     /* make the directory itself */
@@ -147,9 +282,9 @@ static bool srv_start(login &lgn) {
         return false;
     }
     /* ensure it's owned by the user */
-    if (fchownat(
+    if ((!cfg.unprivileged && fchownat(
         dirfd_base, uidbuf, lgn.uid, lgn.gid, AT_SYMLINK_NOFOLLOW
-    ) || fcntl(lgn.dirfd, F_SETFD, FD_CLOEXEC)) {
+    )) || fcntl(lgn.dirfd, F_SETFD, FD_CLOEXEC)) {
         print_err(
             "srv: login dir setup failed for %u (%s)",
             lgn.uid, strerror(errno)
@@ -158,33 +293,60 @@ static bool srv_start(login &lgn) {
         return false;
     }
     print_dbg("srv: create readiness pipe");
-    unlinkat(lgn.dirfd, "ready", 0);
-    if (mkfifoat(lgn.dirfd, "ready", 0700) < 0) {
-        print_err("srv: failed to make ready pipe (%s)", strerror(errno));
-        return false;
-    }
-    /* ensure it's owned by user too, and open in nonblocking mode */
-    if (fchownat(
-        lgn.dirfd, "ready", lgn.uid, lgn.gid, AT_SYMLINK_NOFOLLOW
-    ) || ((lgn.userpipe = openat(
-        lgn.dirfd, "ready", O_NONBLOCK | O_RDONLY
-    )) < 0)) {
-        print_err(
-            "srv: failed to set up ready pipe (%s)", strerror(errno)
-        );
+    /* the write end, only used when passing it by descriptor */
+    int readyfd = -1;
+    if (cfg.ready_fd) {
+        int pfds[2];
+        /* the child makes its end inheritable by the backend by itself */
+        if (pipe2(pfds, O_CLOEXEC) < 0) {
+            print_err("srv: failed to make ready pipe (%s)", strerror(errno));
+            lgn.remove_sdir();
+            return false;
+        }
+        lgn.userpipe = pfds[0];
+        readyfd = pfds[1];
+        if (fcntl(lgn.userpipe, F_SETFL, O_NONBLOCK) < 0) {
+            print_err(
+                "srv: failed to set up ready pipe (%s)", strerror(errno)
+            );
+            srv_start_undo(lgn, readyfd);
+            return false;
+        }
+    } else {
         unlinkat(lgn.dirfd, "ready", 0);
-        lgn.remove_sdir();
-        return false;
+        if (mkfifoat(lgn.dirfd, "ready", 0700) < 0) {
+            print_err("srv: failed to make ready pipe (%s)", strerror(errno));
+            lgn.remove_sdir();
+            return false;
+        }
+        /* ensure it's owned by user too, and open in nonblocking mode */
+        if ((!cfg.unprivileged && fchownat(
+            lgn.dirfd, "ready", lgn.uid, lgn.gid, AT_SYMLINK_NOFOLLOW
+        )) || ((lgn.userpipe = openat(
+            lgn.dirfd, "ready", O_NONBLOCK | O_RDONLY
+        )) < 0)) {
+            print_err(
+                "srv: failed to set up ready pipe (%s)", strerror(errno)
+            );
+            srv_start_undo(lgn, readyfd);
+            return false;
+        }
     }
     /* set up the timer, issue SIGLARM when it fires */
     print_dbg("srv: timer set");
-    if (cdata->login_timeout > 0) {
-        if (!lgn.arm_timer(cdata->login_timeout)) {
+    if (cfg.login_timeout > 0) {
+        if (!lgn.arm_timer(cfg.login_timeout)) {
+            srv_start_undo(lgn, readyfd);
             return false;
         }
     } else {
         print_dbg("srv: no timeout");
     }
+    auto *prof = cfg_find_profile(cfg, lgn);
+    /* not fatal, the service manager just runs wherever we are */
+    if (cg_make(lgn, true)) {
+        cg_limit(lgn, prof);
+    }
     /* launch service manager */
     print_dbg("srv: launch");
     auto pid = fork();
@@ -198,92 +360,49 @@ static bool srv_start(login &lgn) {
         sigaction(SIGALRM, &sa, nullptr);
         sigaction(SIGTERM, &sa, nullptr);
         sigaction(SIGINT, &sa, nullptr);
+        sigaction(SIGUSR1, &sa, nullptr);
+        sigaction(SIGUSR2, &sa, nullptr);
+        sigaction(SIGHUP, &sa, nullptr);
+        sigaction(SIGIO, &sa, nullptr);
         /* close some descriptors, these can be reused */
         close(lgn.userpipe);
         close(dirfd_base);
         close(sigpipe[0]);
         close(sigpipe[1]);
         /* and run the login */
-        bool has_backend = !cdata->disable && (
-            (lgn.uid != 0) || cdata->root_session
-        );
         srv_child(
-            lgn,
-            has_backend ? cdata->backend.data() : nullptr,
-            cdata->manage_rdir
+            lgn, cfg.backend.data(), cfg.manage_rdir, readyfd, prof
         );
         exit(1);
-    } else if (pid < 0) {
+    }
+    if (pid < 0) {
+        rec_add(REC_SRV_FORK_FAIL, lgn.uid, ~0UL, -1, -1, errno);
         print_err("srv: fork failed (%s)", strerror(errno));
+        srv_start_undo(lgn, readyfd);
+        cg_drop(lgn);
         return false;
     }
+    /* the write end belongs to the child now */
+    if (readyfd >= 0) {
+        close(readyfd);
+    }
+    stats_record(STATS_FORK, t_start);
+    rec_add(REC_SRV_FORK, lgn.uid, ~0UL, pid, lgn.userpipe);
+    TRACE(fork, lgn.uid, -1, pid, lgn.userpipe);
+    lgn.t_fork = stats_now();
     /* close the write end on our side */
     lgn.srv_pending = false;
     lgn.srv_pid = pid;
-    if (lgn.userpipe < 0) {
-        /* disabled */
-        return srv_boot(lgn, nullptr);
-    }
-    /* otherwise queue the pipe */
+    /* queue the pipe */
     lgn.pipe_queued = true;
     return true;
 }
 
-static session *get_session(int fd) {
-    for (auto &lgn: logins) {
-        for (auto &sess: lgn.sessions) {
-            if (fd == sess.fd) {
-                return &sess;
-            }
-        }
-    }
-    print_dbg("msg: no session for %d", fd);
-    return nullptr;
-}
-
-static login *login_populate(unsigned int uid) {
-    login *lgn = nullptr;
-    for (auto &lgnr: logins) {
-        if (lgnr.uid == uid) {
-            if (!lgnr.repopulate) {
-                print_dbg("msg: using existing login %u", uid);
-                return &lgnr;
-            }
-            lgn = &lgnr;
-            break;
-        }
-    }
-    auto *pwd = getpwuid(uid);
-    if (!pwd) {
-        print_err("msg: failed to get pwd for %u (%s)", uid, strerror(errno));
-        return nullptr;
-    }
-    if (pwd->pw_dir[0] != '/') {
-        print_err(
-            "msg: homedir of %s (%u) is not absolute (%s)", pwd->pw_name,
-            uid, pwd->pw_dir
-        );
-        return nullptr;
-    }
-    if (lgn) {
-        print_dbg("msg: repopulate login %u", pwd->pw_uid);
-    } else {
-        print_dbg("msg: init login %u", pwd->pw_uid);
-        lgn = &logins.emplace_back();
-    }
-    /* fill in initial login details */
-    lgn->uid = pwd->pw_uid;
-    lgn->gid = pwd->pw_gid;
-    lgn->username = pwd->pw_name;
-    lgn->homedir = pwd->pw_dir;
-    lgn->shell = pwd->pw_shell;
-    lgn->rundir.clear();
-    /* somewhat heuristical */
-    lgn->rundir.reserve(cdata->rdir_path.size() + 8);
-    cfg_expand_rundir(lgn->rundir, cdata->rdir_path.data(), lgn->uid, lgn->gid);
-    lgn->manage_rdir = cdata->manage_rdir && !lgn->rundir.empty();
-    lgn->repopulate = false;
-    return lgn;
+/* sessions are only ever set up by root, which the module runs as; when
+ * unprivileged, the user running the daemon is trusted just the same
+ */
+static bool peer_trusted(uid_t puid) {
+    return !puid || (cdata->unprivileged && (puid == geteuid()));
 }
 
 static session *handle_session_new(int fd, unsigned int uid) {
@@ -292,18 +411,22 @@ static session *handle_session_new(int fd, unsigned int uid) {
     pid_t lpid;
     if (!get_peer_cred(fd, &puid, nullptr, &lpid)) {
         print_dbg("msg: could not get peer credentials");
+        rec_add(REC_MSG_DENIED, uid, ~0UL, -1, fd, errno);
         return nullptr;
     }
-    if (puid != 0) {
+    if (!peer_trusted(puid)) {
         print_dbg("msg: can't set up session (permission denied)");
+        rec_add(REC_MSG_DENIED, uid, ~0UL, lpid, fd);
         return nullptr;
     }
     /* acknowledge the login */
     print_dbg("msg: welcome %u", uid);
-    auto *lgn = login_populate(uid);
+    auto *lgn = login_populate(logins, cfg_cur, uid);
     if (!lgn) {
         return nullptr;
     }
+    /* right away, so that it is running by the end of the handshake */
+    login_thaw(*lgn);
     /* check the sessions */
     for (auto &sess: lgn->sessions) {
         if (sess.fd == fd) {
@@ -318,144 +441,14 @@ static session *handle_session_new(int fd, unsigned int uid) {
     sess.id = ++idbase;
     sess.lgn = lgn;
     sess.lpid = lpid;
+    sess.t_begin = stats_now();
+    rec_add(REC_SESS_NEW, lgn->uid, sess.id, lpid, fd);
     /* initial message */
     sess.needed = 1;
     /* reply */
     return &sess;
 }
 
-static bool write_udata(login const &lgn) {
-    char uname[32], tmpname[32];
-    std::snprintf(tmpname, sizeof(tmpname), "%u.tmp", lgn.uid);
-    std::snprintf(uname, sizeof(uname), "%u", lgn.uid);
-    int omask = umask(0);
-    int lgnfd = openat(
-        dirfd_users, tmpname, O_CREAT | O_TRUNC | O_WRONLY, 0644
-    );
-    if (lgnfd < 0) {
-        print_err("msg: user tmpfile failed (%s)", strerror(errno));
-        umask(omask);
-        return false;
-    }
-    umask(omask);
-    auto *lgnf = fdopen(lgnfd, "w");
-    if (!lgnf) {
-        print_err("msg: user fdopen failed (%s)", strerror(errno));
-        close(lgnfd);
-        return false;
-    }
-    std::fprintf(
-        lgnf,
-        "NAME=%s\n"
-        "RUNTIME=%s\n",
-        lgn.username.data(),
-        lgn.rundir.data()
-    );
-    std::fprintf(lgnf, "SESSIONS=");
-    bool first = true;
-    for (auto &s: lgn.sessions) {
-        if (!first) {
-            std::fprintf(lgnf, " ");
-        }
-        std::fprintf(lgnf, "%lu", s.id);
-        first = false;
-    }
-    std::fprintf(lgnf, "\nSEATS=");
-    first = true;
-    for (auto &s: lgn.sessions) {
-        if (!first) {
-            std::fprintf(lgnf, " ");
-        }
-        if (s.s_seat.empty()) {
-            continue;
-        }
-        std::fprintf(lgnf, "%s", s.s_seat.data());
-        first = false;
-    }
-    std::fprintf(lgnf, "\n");
-    /* done writing */
-    std::fclose(lgnf);
-    /* now rename to real file */
-    if (renameat(dirfd_users, tmpname, dirfd_users, uname) < 0) {
-        print_err("msg: user renameat failed (%s)", strerror(errno));
-        unlinkat(dirfd_users, tmpname, 0);
-        return false;
-    }
-    return true;
-}
-
-static bool write_sdata(session const &sess) {
-    char sessname[32], tmpname[32];
-    std::snprintf(tmpname, sizeof(tmpname), "%lu.tmp", sess.id);
-    std::snprintf(sessname, sizeof(sessname), "%lu", sess.id);
-    auto &lgn = *sess.lgn;
-    int omask = umask(0);
-    int sessfd = openat(
-        dirfd_sessions, tmpname, O_CREAT | O_TRUNC | O_WRONLY, 0644
-    );
-    if (sessfd < 0) {
-        print_err("msg: session tmpfile failed (%s)", strerror(errno));
-        umask(omask);
-        return false;
-    }
-    umask(omask);
-    auto *sessf = fdopen(sessfd, "w");
-    if (!sessf) {
-        print_err("msg: session fdopen failed (%s)", strerror(errno));
-        close(sessfd);
-        return false;
-    }
-    /* now write all the session data */
-    std::fprintf(
-        sessf,
-        "UID=%u\n"
-        "USER=%s\n",
-        lgn.uid,
-        lgn.username.data()
-    );
-    if (sess.vtnr) {
-        std::fprintf(sessf, "IS_DISPLAY=1\n");
-    }
-    std::fprintf(sessf, "REMOTE=%d\n", int(sess.remote));
-    std::fprintf(sessf, "TYPE=%s\n", sess.s_type.data());
-    std::fprintf(sessf, "ORIGINAL_TYPE=%s\n", sess.s_type.data());
-    std::fprintf(sessf, "CLASS=%s\n", sess.s_class.data());
-    if (!sess.s_seat.empty()) {
-        std::fprintf(sessf, "SEAT=%s\n", sess.s_seat.data());
-    }
-    if (!sess.s_tty.empty()) {
-        std::fprintf(sessf, "TTY=%s\n", sess.s_tty.data());
-    }
-    if (!sess.s_service.empty()) {
-        std::fprintf(sessf, "SERVICE=%s\n", sess.s_service.data());
-    }
-    if (sess.vtnr) {
-        std::fprintf(sessf, "VTNR=%lu\n", sess.vtnr);
-    }
-    std::fprintf(sessf, "LEADER=%ld\n", long(sess.lpid));
-    /* done writing */
-    std::fclose(sessf);
-    /* now rename to real file */
-    if (renameat(dirfd_sessions, tmpname, dirfd_sessions, sessname) < 0) {
-        print_err("msg: session renameat failed (%s)", strerror(errno));
-        unlinkat(dirfd_sessions, tmpname, 0);
-        return false;
-    }
-    return write_udata(lgn);
-}
-
-static void drop_udata(login const &lgn) {
-    char lgname[64];
-    std::snprintf(lgname, sizeof(lgname), "%u", lgn.uid);
-    unlinkat(dirfd_users, lgname, 0);
-}
-
-static void drop_sdata(session const &sess) {
-    char sessname[64];
-    std::snprintf(sessname, sizeof(sessname), "%lu", sess.id);
-    unlinkat(dirfd_sessions, sessname, 0);
-}
-
 static bool sock_block(int fd, short events) {
     if (errno == EINTR) {
         return true;
@@ -503,65 +496,27 @@ static bool send_msg(int fd, unsigned char msg) {
     if (!send_full(fd, &msg, sizeof(msg))) {
         return false;
     }
+    cap_add(CAP_SEND, fd, &msg, sizeof(msg));
     return (msg != MSG_ERR);
 }
 
-static bool recv_val(int fd, void *buf, size_t sz) {
-    auto ret = recv(fd, buf, sz, 0);
-    if (ret < 0) {
-        if (errno == EINTR) {
-            return recv_val(fd, buf, sz);
-        }
-        print_err("msg: recv failed (%s)", strerror(errno));
-    }
-    if (size_t(ret) != sz) {
-        print_err("msg: partial recv despite peek");
-        return false;
-    }
-    return true;
-}
-
-static bool recv_str(
-    session &sess, std::string &outs, unsigned int minlen, unsigned int maxlen
-) {
-    char buf[1024];
-    if (!sess.str_left) {
-        print_dbg("msg: str start");
-        outs.clear();
-        size_t slen;
-        if (!recv_val(sess.fd, &slen, sizeof(slen))) {
-            return false;
-        }
-        if ((slen < minlen) || (slen > maxlen)) {
-            print_err("msg: invalid string length");
-            return false;
-        }
-        sess.str_left = slen;
-        /* we are awaiting string, which may come in arbitrary chunks */
-        sess.needed = 0;
-        return true;
-    }
-    auto left = sess.str_left;
-    if (left > sizeof(buf)) {
-        left = sizeof(buf);
-    }
-    auto ret = recv(sess.fd, buf, left, 0);
-    if (ret < 0) {
-        if (errno == EINTR) {
-            return recv_str(sess, outs, minlen, maxlen);
-        } else if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
-            return true;
-        }
+/* a request to dump the flight recorder, which only root may do (or the
+ * user running an unprivileged daemon)
+ */
+static bool handle_rec_dump(int fd) {
+    uid_t puid;
+    if (!get_peer_cred(fd, &puid, nullptr, nullptr) || !peer_trusted(puid)) {
+        print_dbg("msg: can't dump events (permission denied)");
+        rec_add(REC_MSG_DENIED, ~0U, ~0UL, -1, fd);
+        return send_msg(fd, MSG_ERR);
     }
-    outs.append(buf, ret);
-    sess.str_left -= ret;
-    return true;
+    return send_msg(fd, rec_dump(dirfd_base) ? MSG_OK_DONE : MSG_ERR);
 }
 
 static bool handle_read(int fd) {
     int sess_needed;
     /* try get existing session */
-    auto *sess = get_session(fd);
+    auto *sess = get_session(logins, fd);
     int *pidx = nullptr;
     /* no session: initialize one, expect initial data */
     if (!sess) {
@@ -594,11 +549,16 @@ static bool handle_read(int fd) {
         if (!recv_val(fd, &msg, sizeof(msg))) {
             return false;
         }
+        cap_add(CAP_RECV, fd, &msg, sizeof(msg));
+        if (msg == MSG_REC_DUMP) {
+            return handle_rec_dump(fd);
+        }
         if (msg != MSG_START) {
             /* unexpected message */
             print_err("msg: expected MSG_START, got %u", msg);
             return false;
         }
+        rec_add(REC_MSG_START, ~0U, ~0UL, -1, fd);
         pending_sess.push_back(fd);
         return true;
     }
@@ -621,89 +581,66 @@ static bool handle_read(int fd) {
     }
     /* handle the right section of handshake */
     if (sess->handshake) {
-        if (sess->pend_vtnr) {
-            print_dbg("msg: get session vtnr");
-            if (!recv_val(fd, &sess->vtnr, sizeof(sess->vtnr))) {
-                return false;
-            }
-            /* remote */
-            sess->needed = sizeof(bool);
-            sess->pend_vtnr = 0;
-            return true;
+        if (!sess_handshake(*sess)) {
+            return false;
         }
-        if (sess->pend_remote) {
-            print_dbg("msg: get remote");
-            if (!recv_val(fd, &sess->remote, sizeof(sess->remote))) {
-                return false;
-            }
-            /* service str */
-            sess->needed = sizeof(size_t);
-            sess->pend_remote = 0;
+        if (sess->pend_rhost) {
+            /* more to come */
             return true;
         }
-#define GET_STR(type, min, max, code) \
-        if (sess->pend_##type) { \
-            print_dbg("msg: get " #type); \
-            if (!recv_str(*sess, sess->s_##type, min, max)) { \
-                return false; \
-            } \
-            if (!sess->str_left) { \
-                sess->pend_##type = false; \
-                /* we are waiting for length of next string */ \
-                sess->needed = sizeof(size_t); \
-                print_dbg("msg: got \"%s\"", sess->s_##type.data()); \
-                code \
-            } \
-            return true; \
-        }
-        GET_STR(service, 1, 64,)
-        GET_STR(type, 1, 16,)
-        GET_STR(class, 1, 16,)
-        GET_STR(desktop, 0, 64,)
-        GET_STR(seat, 0, 32,)
-        GET_STR(tty, 0, 16,)
-        GET_STR(display, 0, 16,)
-        GET_STR(ruser, 0, 256,)
-        GET_STR(rhost, 0, 256, goto handshake_finish;)
-#undef GET_STR
-        /* should be unreachable */
-        print_dbg("msg: unreachable handshake");
-        return false;
-    }
-handshake_finish:
-    if (sess->handshake) {
         /* from this point the protocol is byte-sized messages only */
         sess->needed = sizeof(unsigned char);
         sess->handshake = 0;
+        cap_handshake(*sess);
+        stats_record(STATS_HANDSHAKE, sess->t_begin);
+        stats_count(STATS_LOGINS);
+        rec_add(REC_SESS_HANDSHAKE, sess->lgn->uid, sess->id, sess->lpid, fd);
+        TRACE(handshake, sess->lgn->uid, sess->id, sess->lpid, fd);
         /* finish startup */
         if (!sess->lgn->srv_wait) {
             /* already started, reply with ok */
             print_dbg("msg: done");
             /* establish internal session file */
-            if (!write_sdata(*sess)) {
+            if (!write_sdata(*sess, dirfd_sessions, dirfd_users)) {
                 return false;
             }
             if (!send_msg(fd, MSG_OK_DONE)) {
                 return false;
             }
+            rec_add(REC_SESS_DONE, sess->lgn->uid, sess->id, sess->lpid, fd);
+            TRACE(ok_done, sess->lgn->uid, sess->id, sess->lpid, fd);
+            stats_record(STATS_LOGIN, sess->t_begin);
+            sess->t_begin = 0;
         } else {
             if (sess->lgn->srv_pid == -1) {
                 if (sess->lgn->term_pid != -1) {
                     /* still waiting for old service manager to die */
                     print_dbg("msg: still waiting for old srv term");
                     sess->lgn->srv_pending = true;
+                } else if (sess->lgn->srv_restart) {
+                    /* it crashed and is about to be restarted */
+                    print_dbg("msg: waiting for srv restart");
+                    if (!write_sdata(*sess, dirfd_sessions, dirfd_users)) {
+                        return false;
+                    }
                 } else {
+                    /* establish internal session file */
+                    if (!write_sdata(*sess, dirfd_sessions, dirfd_users)) {
+                        return false;
+                    }
                     print_dbg("msg: start service manager");
                     if (!srv_start(*sess->lgn)) {
                         return false;
                     }
-                    /* establish internal session file */
-                    if (!write_sdata(*sess)) {
-                        return false;
+                    if (!sess->lgn->srv_wait) {
+                        /* started synchronously, already replied with ok */
+                        print_dbg("msg: done");
+                        return true;
                     }
                 }
             }
             print_dbg("msg: wait");
+            rec_add(REC_SESS_WAIT, sess->lgn->uid, sess->id, sess->lpid, fd);
             return send_msg(fd, MSG_OK_WAIT);
         }
         return true;
@@ -713,11 +650,13 @@ handshake_finish:
     if (!recv_val(fd, &msg, sizeof(msg))) {
         return false;
     }
+    cap_add(CAP_RECV, fd, &msg, sizeof(msg));
     if (msg != MSG_REQ_ENV) {
         print_err("msg: invalid message %u (%d)", msg, fd);
         return false;
     }
     print_dbg("msg: session environment request");
+    auto t_env = stats_now();
     /* data message */
     if (!send_msg(fd, MSG_ENV)) {
         return false;
@@ -726,7 +665,12 @@ handshake_finish:
     if (!rlen) {
         /* no rundir means no env, send a zero */
         print_dbg("msg: no rundir, not sending env");
-        return send_full(fd, &rlen, sizeof(rlen));
+        if (!send_full(fd, &rlen, sizeof(rlen))) {
+            return false;
+        }
+        stats_record(STATS_ENV, t_env);
+        rec_add(REC_SESS_ENV, sess->lgn->uid, sess->id, sess->lpid, fd);
+        return true;
     }
     /* we have a rundir, compute an environment block */
     unsigned int elen = 0;
@@ -736,7 +680,8 @@ handshake_finish:
     char const rpfx[] = "XDG_RUNTIME_DIR=";
     char const dsfx[] = "/bus";
     /* we can optionally export session bus address */
-    if (cdata->export_dbus) {
+    auto &cfg = *sess->lgn->cfg;
+    if (cfg.export_dbus) {
         /* check if the session bus socket exists */
         struct stat sbuf;
         /* first get the rundir descriptor */
@@ -756,7 +701,7 @@ handshake_finish:
         }
     }
     /* we can also export rundir if we're managing it */
-    if (cdata->manage_rdir) {
+    if (cfg.manage_rdir) {
         /* includes null terminator */
         elen += sizeof("XDG_RUNTIME_DIR=");
         elen += rlen;
@@ -768,7 +713,7 @@ handshake_finish:
     }
     auto &rdir = sess->lgn->rundir;
     /* now send rundir if we have it */
-    if (cdata->manage_rdir) {
+    if (cfg.manage_rdir) {
         if (!send_full(fd, rpfx, sizeof(rpfx) - 1)) {
             return false;
         }
@@ -791,6 +736,8 @@ handshake_finish:
         }
     }
     print_dbg("msg: sent env, done");
+    stats_record(STATS_ENV, t_env);
+    rec_add(REC_SESS_ENV, sess->lgn->uid, sess->id, sess->lpid, fd);
     /* we've sent all */
     return true;
 }
@@ -815,13 +762,13 @@ static void timer_handler(int sign, siginfo_t *si, void *) {
 }
 
 static bool check_linger(login const &lgn) {
-    if (cdata->linger_never) {
+    if (lgn.cfg->linger_never) {
         return false;
     }
-    if (cdata->linger) {
+    if (lgn.cfg->linger) {
         return true;
     }
-    int dfd = open(LINGER_PATH, O_RDONLY);
+    int dfd = open(lgn.cfg->linger_path.data(), O_RDONLY);
     if (dfd < 0) {
         return false;
     }
@@ -833,6 +780,75 @@ static bool check_linger(login const &lgn) {
     return ret;
 }
 
+/* the service manager is gone, so anything left in its cgroup has
+ * escaped it and is killed; the cgroup is removed once it is empty
+ */
+static void srv_cg_clean(login &lgn) {
+    if (lgn.cg_wd < 0) {
+        return;
+    }
+    /* or a new service manager would start out frozen */
+    login_thaw(lgn);
+    if (cg_kill(lgn)) {
+        rec_add(REC_CG_KILL, lgn.uid);
+    }
+    if (cg_drop(lgn)) {
+        rec_add(REC_CG_EMPTY, lgn.uid);
+    }
+}
+
+/* kill a service manager that refuses to stop, along with its cgroup;
+ * the process holding its session turns the repeated SIGTERM into a
+ * SIGKILL and stays outside of the cgroup, so it still gets to close it
+ */
+static void srv_kill(login &lgn) {
+    kill(lgn.term_pid, SIGTERM);
+    if (cg_kill(lgn)) {
+        rec_add(REC_CG_KILL, lgn.uid);
+    }
+    stats_count(STATS_KILLS);
+    lgn.kill_tried = true;
+}
+
+/* stop the service manager of a login, if it has one */
+static void login_stop(login &lgn) {
+    print_dbg("srv: stop");
+    /* it has to be running to be able to stop */
+    login_thaw(lgn);
+    if (lgn.srv_restart) {
+        /* nothing to restart anymore */
+        lgn.disarm_timer();
+        lgn.srv_restart = false;
+    }
+    if (lgn.srv_pid != -1) {
+        print_dbg("srv: term");
+        rec_add(REC_SRV_STOP, lgn.uid, ~0UL, lgn.srv_pid);
+        kill(lgn.srv_pid, SIGTERM);
+        lgn.term_pid = lgn.srv_pid;
+        /* replaces the login timeout, if still running */
+        lgn.disarm_timer();
+        /* just in case; when shutting down, there is a global deadline */
+        if (!term) {
+            lgn.arm_timer(kill_timeout);
+        }
+    } else {
+        /* if no service manager, drop the dir early; otherwise
+         * wait because we need to remove the boot service first
+         */
+        lgn.remove_sdir();
+        drop_udata(lgn, dirfd_users);
+        /* without a backend, nothing else will clear the rundir */
+        if ((lgn.term_pid == -1) && lgn.manage_rdir) {
+            rundir_clear(lgn.rundir.data());
+            lgn.manage_rdir = false;
+            lgn.repopulate = true;
+        }
+    }
+    lgn.srv_pid = -1;
+    lgn.start_pid = -1;
+    lgn.srv_wait = true;
+}
+
 /* terminate given conn, but only if within login */
 static bool conn_term_login(login &lgn, int conn) {
     for (auto cit = lgn.sessions.begin(); cit != lgn.sessions.end(); ++cit) {
@@ -840,29 +856,21 @@ static bool conn_term_login(login &lgn, int conn) {
             continue;
         }
         print_dbg("conn: close %d for login %u", conn, lgn.uid);
-        drop_sdata(*cit);
+        rec_add(REC_CONN_CLOSE, lgn.uid, cit->id, cit->lpid, conn);
+        TRACE(conn_term, lgn.uid, cit->id, cit->lpid, conn);
+        drop_sdata(*cit, dirfd_sessions);
         lgn.sessions.erase(cit);
-        write_udata(lgn);
-        /* empty now; shut down login */
-        if (lgn.sessions.empty() && !check_linger(lgn)) {
-            print_dbg("srv: stop");
-            if (lgn.srv_pid != -1) {
-                print_dbg("srv: term");
-                kill(lgn.srv_pid, SIGTERM);
-                lgn.term_pid = lgn.srv_pid;
-                /* just in case */
-                lgn.arm_timer(kill_timeout);
+        write_udata(lgn, dirfd_users);
+        /* empty now; shut down login, or let it idle if lingering */
+        if (lgn.sessions.empty()) {
+            lgn.t_idle = stats_now();
+            if (!check_linger(lgn)) {
+                login_stop(lgn);
             } else {
-                /* if no service manager, drop the dir early; otherwise
-                 * wait because we need to remove the boot service first
-                 */
-                lgn.remove_sdir();
-                drop_udata(lgn);
+                login_idle(lgn);
             }
-            lgn.srv_pid = -1;
-            lgn.start_pid = -1;
-            lgn.srv_wait = true;
         }
+        cap_add(CAP_CLOSE, conn);
         close(conn);
         return true;
     }
@@ -883,6 +891,7 @@ static void conn_term(int conn) {
         }
     }
     /* in any case, close */
+    cap_add(CAP_CLOSE, conn);
     close(conn);
 }
 
@@ -951,7 +960,8 @@ fail:
 static bool drop_login(login &lgn) {
     /* terminate all connections belonging to this login */
     print_dbg("turnstiled: drop login %u", lgn.uid);
-    for (std::size_t j = 2; j < fds.size(); ++j) {
+    rec_add(REC_LOGIN_DROP, lgn.uid);
+    for (std::size_t j = nfixed; j < fds.size(); ++j) {
         if (conn_term_login(lgn, fds[j].fd)) {
             fds[j].fd = -1;
             fds[j].revents = 0;
@@ -968,58 +978,341 @@ static bool drop_login(login &lgn) {
     return true;
 }
 
-static bool sig_handle_term() {
-    print_dbg("turnstiled: term");
-    bool succ = true;
-    /* close the control socket */
-    close(ctl_sock);
-    /* drop logins */
-    for (auto &lgn: logins) {
-        if (!drop_login(lgn)) {
-            succ = false;
-        }
+/* set up a timer that is not tied to a login; its alarms are identified
+ * by the address of the timer itself
+ */
+static bool timer_arm(timer_t &timer, std::time_t timeout, bool repeat) {
+    sigevent sev{};
+    sev.sigev_notify = SIGEV_SIGNAL;
+    sev.sigev_signo = SIGALRM;
+    sev.sigev_value.sival_ptr = &timer;
+    if (timer_create(CLOCK_MONOTONIC, &sev, &timer) < 0) {
+        print_err("timer: timer_create failed (%s)", strerror(errno));
+        return false;
     }
-    /* shrink the descriptor list to just signal pipe */
-    fds.resize(1);
-    return succ;
-}
-
-static bool sig_handle_alrm(void *data) {
-    print_dbg("turnstiled: sigalrm");
-    auto &lgn = *static_cast<login *>(data);
-    /* disarm the timer if armed */
-    if (lgn.timer_armed) {
-        print_dbg("turnstiled: drop timer");
-        lgn.disarm_timer();
-    } else {
-        print_dbg("turnstiled: spurious alarm, ignoring");
-        return true;
+    itimerspec tval{};
+    tval.it_value.tv_sec = timeout;
+    if (repeat) {
+        tval.it_interval.tv_sec = timeout;
     }
-    if (lgn.term_pid != -1) {
-        if (lgn.kill_tried) {
-            print_err(
-                "turnstiled: service manager process %ld refused to die",
-                static_cast<long>(lgn.term_pid)
-            );
-            return false;
-        }
-        /* waiting for service manager to die and it did not die, try again
-         * this will propagate as SIGKILL in the double-forked process
-         */
-        kill(lgn.term_pid, SIGTERM);
-        lgn.kill_tried = true;
-        /* re-arm the timer, if that fails again, we give up */
-        lgn.arm_timer(kill_timeout);
-        return true;
+    if (timer_settime(timer, 0, &tval, nullptr) < 0) {
+        print_err("timer: timer_settime failed (%s)", strerror(errno));
+        timer_delete(timer);
+        return false;
     }
-    /* terminate all connections belonging to this login */
-    return drop_login(lgn);
+    return true;
 }
 
-/* this is called upon receiving a SIGCHLD
- *
- * can happen for 3 things:
- *
+static bool term_arm(std::time_t timeout) {
+    term_timer_armed = timer_arm(term_timer, timeout, false);
+    return term_timer_armed;
+}
+
+/* (re)subscribe to memory pressure, as configured */
+static void pressure_arm() {
+    auto &pfd = fds[2];
+    if (pfd.fd >= 0) {
+        close(pfd.fd);
+        pfd.fd = -1;
+    }
+    pfd.revents = 0;
+    if (cdata->pressure_path.empty()) {
+        return;
+    }
+    pfd.fd = psi_open(
+        cdata->pressure_path.data(), cdata->pressure_stall,
+        cdata->pressure_window
+    );
+}
+
+/* (re)start writing the stats file periodically */
+static void stats_arm() {
+    if (stats_timer_armed) {
+        timer_delete(stats_timer);
+        stats_timer_armed = false;
+    }
+    if (cdata->stats_interval <= 0) {
+        unlinkat(dirfd_base, "stats", 0);
+        return;
+    }
+    stats_write(dirfd_base);
+    stats_timer_armed = timer_arm(stats_timer, cdata->stats_interval, true);
+}
+
+static void cfg_finalize(cfg_data &cfg) {
+    if (!cfg.manage_rdir && !std::getenv(
+        "TURNSTILED_LINGER_ENABLE_FORCE"
+    )) {
+        /* we don't want to linger when we are not in charge of the rundir,
+         * because services may be relying on it; we can never really delete
+         * the rundir when lingering, and something like elogind might
+         *
+         * for those who are aware of the consequences and have things handled
+         * on their own, they can start the daemon with the env variable
+         */
+        cfg.linger_never = true;
+    }
+    /* without root, there is no identity to switch to */
+    if (geteuid() != 0) {
+        cfg.unprivileged = true;
+    }
+}
+
+/* apply the settings given on the command line over the configuration */
+static bool cfg_override(cfg_data &cfg) {
+    bool valid = true;
+    for (auto *ov: cfg_overrides) {
+        auto *eq = std::strchr(ov, '=');
+        std::string name{ov, std::size_t(eq - ov)};
+        if (!cfg_set(cfg, name.data(), eq + 1, valid)) {
+            print_err("turnstiled: unknown setting '%s'", name.data());
+            valid = false;
+        }
+    }
+    return valid;
+}
+
+/* the base and state directories and the cgroups are in use and the
+ * identity switching is decided once, so these only change with a restart
+ */
+static void cfg_keep_fixed(cfg_data &ncfg, cfg_data const &ocfg) {
+    if (
+        (ncfg.base_path != ocfg.base_path) ||
+        (ncfg.state_path != ocfg.state_path) ||
+        (ncfg.unprivileged != ocfg.unprivileged) ||
+        (ncfg.cgroup_path != ocfg.cgroup_path)
+    ) {
+        print_log(
+            LOG_WARNING, "turnstiled: base_path, state_path, unprivileged "
+            "and cgroup_path are only changed on restart"
+        );
+    }
+    ncfg.base_path = ocfg.base_path;
+    ncfg.state_path = ocfg.state_path;
+    ncfg.unprivileged = ocfg.unprivileged;
+    ncfg.cgroup_path = ocfg.cgroup_path;
+}
+
+/* read the configuration again; it is only swapped in if it is valid,
+ * and logins that are already set up keep using the one they started with
+ */
+static void sig_handle_reload() {
+    print_dbg("turnstiled: reload");
+    rec_add(REC_DAEMON_RELOAD);
+    std::shared_ptr<cfg_data> ncfg;
+    try {
+        ncfg = std::make_shared<cfg_data>();
+    } catch (std::bad_alloc const &) {
+        print_err("turnstiled: failed to allocate configuration");
+        return;
+    }
+    if (!cfg_read(cfg_path, *ncfg) || !cfg_override(*ncfg)) {
+        print_err("turnstiled: configuration not valid, keeping the old one");
+        return;
+    }
+    cfg_finalize(*ncfg);
+    cfg_keep_fixed(*ncfg, *cdata);
+    cfg_cur = std::move(ncfg);
+    cdata = cfg_cur.get();
+    stats_arm();
+    pressure_arm();
+    cap_open(cdata->capture_path.data(), cdata->capture_anon);
+    print_log(LOG_INFO, "Configuration reloaded");
+}
+
+static bool sig_handle_term() {
+    print_dbg("turnstiled: term");
+    rec_add(REC_DAEMON_TERM);
+    bool succ = true;
+    term = true;
+    /* close the control socket */
+    close(ctl_sock);
+    /* drop logins; this stops all managers that are not lingering */
+    for (auto &lgn: logins) {
+        if (!drop_login(lgn)) {
+            succ = false;
+        }
+    }
+    /* and then the rest, so that they all go down in parallel */
+    for (auto &lgn: logins) {
+        /* nothing is to be started anymore */
+        lgn.srv_pending = false;
+        lgn.srv_restart = false;
+        if (lgn.srv_pid != -1) {
+            login_stop(lgn);
+        }
+        /* the per-login timers are superseded by the deadline */
+        lgn.disarm_timer();
+        lgn.kill_tried = false;
+    }
+    if (cdata->shutdown_timeout > 0) {
+        term_arm(cdata->shutdown_timeout);
+    }
+    /* shrink the descriptor list to just signal pipe, the other fixed
+     * entries stay in place but are not polled anymore
+     */
+    fds.resize(nfixed);
+    fds[1].fd = -1;
+    if (fds[2].fd >= 0) {
+        close(fds[2].fd);
+        fds[2].fd = -1;
+    }
+    return succ;
+}
+
+static bool sig_handle_deadline() {
+    if (!term_timer_armed) {
+        return true;
+    }
+    timer_delete(term_timer);
+    term_timer_armed = false;
+    if (term_killed) {
+        for (auto &lgn: logins) {
+            if (lgn.term_pid != -1) {
+                print_err(
+                    "turnstiled: service manager process %ld refused to die",
+                    static_cast<long>(lgn.term_pid)
+                );
+            }
+        }
+        return false;
+    }
+    /* everything that is still around gets killed all at once */
+    for (auto &lgn: logins) {
+        if (lgn.term_pid == -1) {
+            continue;
+        }
+        print_err(
+            "turnstiled: service manager for %s (%u) did not stop in time",
+            lgn.username.data(), lgn.uid
+        );
+        rec_add(REC_DAEMON_DEADLINE, lgn.uid, ~0UL, lgn.term_pid);
+        srv_kill(lgn);
+    }
+    term_killed = true;
+    return term_arm(kill_grace);
+}
+
+static bool sig_handle_alrm(void *data) {
+    print_dbg("turnstiled: sigalrm");
+    if (data == &term_timer) {
+        return sig_handle_deadline();
+    }
+    if (data == &stats_timer) {
+        stats_write(dirfd_base);
+        return true;
+    }
+    auto &lgn = *static_cast<login *>(data);
+    /* disarm the timer if armed */
+    if (lgn.timer_armed) {
+        print_dbg("turnstiled: drop timer");
+        lgn.disarm_timer();
+    } else {
+        print_dbg("turnstiled: spurious alarm, ignoring");
+        return true;
+    }
+    rec_add(
+        REC_LOGIN_TIMER, lgn.uid, ~0UL,
+        (lgn.term_pid != -1) ? lgn.term_pid : lgn.srv_pid
+    );
+    TRACE(
+        timer, lgn.uid, -1, (lgn.term_pid != -1) ? lgn.term_pid : lgn.srv_pid, -1
+    );
+    if (lgn.srv_restart) {
+        /* restart delay is up */
+        lgn.srv_restart = false;
+        return srv_start(lgn);
+    }
+    if (lgn.srv_freeze) {
+        /* been idle for long enough */
+        lgn.srv_freeze = false;
+        if (cg_freeze(lgn, true)) {
+            print_dbg("srv: froze %u", lgn.uid);
+            rec_add(REC_CG_FREEZE, lgn.uid);
+            lgn.frozen = true;
+        }
+        return true;
+    }
+    if (lgn.term_pid != -1) {
+        if (lgn.kill_tried) {
+            print_err(
+                "turnstiled: service manager process %ld refused to die",
+                static_cast<long>(lgn.term_pid)
+            );
+            return false;
+        }
+        /* waiting for service manager to die and it did not die, kill it */
+        rec_add(REC_SRV_KILL, lgn.uid, ~0UL, lgn.term_pid);
+        srv_kill(lgn);
+        /* re-arm the timer, if that fails again, we give up; killing a
+         * whole cgroup does not need to wait for anybody to cooperate
+         */
+        lgn.arm_timer((lgn.cg_wd >= 0) ? kill_grace : kill_timeout);
+        return true;
+    }
+    /* the login took too long, terminate all its connections */
+    stats_count(STATS_TIMEOUTS);
+    return drop_login(lgn);
+}
+
+/* schedule a restart of a service manager that died after having been
+ * ready; a manager that keeps crashing is given up on once it has used
+ * up its restart budget, so it does not keep eating resources, and the
+ * login is marked failed until another session comes in
+ */
+static bool srv_restart(login &lgn) {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    auto &cfg = *lgn.cfg;
+    if ((now.tv_sec - lgn.restart_stamp) >= cfg.restart_interval) {
+        /* been running long enough, start a new window */
+        lgn.restart_stamp = now.tv_sec;
+        lgn.restart_count = 0;
+    }
+    ++lgn.restart_count;
+    if (
+        (cfg.restart_limit > 0) &&
+        (lgn.restart_count > std::size_t(cfg.restart_limit))
+    ) {
+        print_err(
+            "srv: service manager for %u keeps crashing, giving up", lgn.uid
+        );
+        lgn.srv_failed = true;
+        stats_count(STATS_FAILURES);
+        rec_add(REC_SRV_FAILED, lgn.uid);
+        lgn.srv_wait = true;
+        lgn.remove_sdir();
+        write_udata(lgn, dirfd_users);
+        return true;
+    }
+    ++lgn.restart_total;
+    stats_count(STATS_RESTARTS);
+    write_udata(lgn, dirfd_users);
+    /* double the delay with every restart in the window */
+    long delay = restart_delay_max;
+    if (lgn.restart_count < 16) {
+        delay = std::min(
+            delay, restart_delay_min << (lgn.restart_count - 1)
+        );
+    }
+    /* and spread it out to anywhere between half and the full delay */
+    delay = delay / 2 + long(jitter_rng() % (delay / 2 + 1));
+    print_dbg("srv: restart %u in %ld ms", lgn.uid, delay);
+    rec_add(REC_SRV_RESTART, lgn.uid);
+    lgn.srv_wait = true;
+    lgn.srv_restart = true;
+    if (!lgn.arm_timer(delay / 1000, (delay % 1000) * 1000000)) {
+        /* no way to delay it */
+        lgn.srv_restart = false;
+        return srv_start(lgn);
+    }
+    return true;
+}
+
+/* this is called upon receiving a SIGCHLD
+ *
+ * can happen for 3 things:
+ *
  * the service manager instance which is still supposed to be running, in
  * which case we attempt to restart it (except if it never signaled readiness,
  * in which case we give up, as we'd likely loop forever)
@@ -1036,6 +1329,9 @@ static bool srv_reaper(pid_t pid) {
     print_dbg("srv: reap %u", (unsigned int)pid);
     for (auto &lgn: logins) {
         if (pid == lgn.srv_pid) {
+            rec_add(REC_SRV_REAP, lgn.uid, ~0UL, pid);
+            TRACE(reap_srv, lgn.uid, -1, pid, -1);
+            srv_cg_clean(lgn);
             lgn.srv_pid = -1;
             lgn.start_pid = -1; /* we don't care anymore */
             lgn.disarm_timer();
@@ -1051,19 +1347,19 @@ static bool srv_reaper(pid_t pid) {
                 }
                 return drop_login(lgn);
             }
-            return srv_start(lgn);
+            return srv_restart(lgn);
         } else if (pid == lgn.start_pid) {
+            rec_add(REC_SRV_REAP, lgn.uid, ~0UL, pid);
+            TRACE(reap_boot, lgn.uid, -1, pid, -1);
             /* reaping service startup jobs */
             print_dbg("srv: ready notification");
-            for (auto &sess: lgn.sessions) {
-                send_msg(sess.fd, MSG_OK_DONE);
-            }
-            /* disarm an associated timer */
-            print_dbg("srv: disarm timer");
-            lgn.disarm_timer();
-            lgn.start_pid = -1;
-            lgn.srv_wait = false;
+            rec_add(REC_SRV_READY, lgn.uid, ~0UL, pid);
+            stats_record(STATS_READY, lgn.t_boot);
+            srv_ready(lgn);
         } else if (pid == lgn.term_pid) {
+            rec_add(REC_SRV_REAP, lgn.uid, ~0UL, pid);
+            TRACE(reap_term, lgn.uid, -1, pid, -1);
+            srv_cg_clean(lgn);
             /* if there was a timer on the login, safe to drop it now */
             lgn.disarm_timer();
             lgn.remove_sdir();
@@ -1074,7 +1370,7 @@ static bool srv_reaper(pid_t pid) {
             }
             /* mark to repopulate if there are no sessions */
             if (lgn.sessions.empty()) {
-                drop_udata(lgn);
+                drop_udata(lgn, dirfd_users);
                 lgn.repopulate = true;
             }
             lgn.term_pid = -1;
@@ -1106,6 +1402,30 @@ static bool sig_handle_chld() {
     return true;
 }
 
+/* a cgroup changed; the ones that have no service manager anymore are
+ * removed once the last process in them is gone
+ */
+static void sig_handle_io() {
+    static std::vector<int> wds;
+    print_dbg("turnstiled: sigio");
+    if (!cg_events(wds)) {
+        print_err("cgroup: failed to read events (%s)", strerror(errno));
+        return;
+    }
+    for (auto &lgn: logins) {
+        if (
+            (lgn.cg_wd < 0) || (lgn.srv_pid != -1) || (lgn.term_pid != -1) ||
+            (std::find(wds.begin(), wds.end(), lgn.cg_wd) == wds.end())
+        ) {
+            continue;
+        }
+        if (cg_drop(lgn)) {
+            print_dbg("cgroup: removed cgroup of %u", lgn.uid);
+            rec_add(REC_CG_EMPTY, lgn.uid);
+        }
+    }
+}
+
 static bool fd_handle_pipe(std::size_t i) {
     if (fds[i].revents == 0) {
         return true;
@@ -1124,22 +1444,34 @@ static bool fd_handle_pipe(std::size_t i) {
     }
     bool done = false;
     if (fds[i].revents & POLLIN) {
-        /* read the string from the pipe */
+        /* read the string from the pipe, it may come in pieces */
+        char buf[256];
         for (;;) {
-            char c;
-            if (read(fds[i].fd, &c, 1) != 1) {
+            auto ret = read(fds[i].fd, buf, sizeof(buf));
+            if (ret <= 0) {
+                if ((ret < 0) && (errno == EINTR)) {
+                    continue;
+                }
                 break;
             }
-            if (c == '\0') {
-                /* done receiving */
+            auto *end = static_cast<char *>(std::memchr(buf, '\0', ret));
+            if (end) {
+                /* done receiving, anything past the terminator is junk */
+                lgn->srvstr.append(buf, end - buf);
                 done = true;
                 break;
             }
-            lgn->srvstr.push_back(c);
+            lgn->srvstr.append(buf, ret);
+            if (std::size_t(ret) < sizeof(buf)) {
+                /* drained for now, we will be polled again for the rest */
+                break;
+            }
         }
     }
     if (done || (fds[i].revents & POLLHUP)) {
         print_dbg("pipe: close");
+        rec_add(REC_SRV_PIPE, lgn->uid, ~0UL, lgn->srv_pid, lgn->userpipe);
+        TRACE(ready_pipe, lgn->uid, -1, lgn->srv_pid, lgn->userpipe);
         /* kill the pipe, we don't need it anymore */
         close(lgn->userpipe);
         lgn->userpipe = -1;
@@ -1148,14 +1480,20 @@ static bool fd_handle_pipe(std::size_t i) {
         fds[i].fd = -1;
         fds[i].revents = 0;
         --npipes;
-        /* unlink the pipe */
-        unlinkat(lgn->dirfd, "ready", 0);
+        /* unlink the pipe, if it was a named one */
+        if (!lgn->cfg->ready_fd) {
+            unlinkat(lgn->dirfd, "ready", 0);
+        }
         print_dbg("pipe: gone");
+        stats_record(STATS_RUN, lgn->t_fork);
+        lgn->t_boot = stats_now();
         /* wait for the boot service to come up */
-        if (!srv_boot(*lgn, cdata->backend.data())) {
+        if (!srv_boot(*lgn, lgn->cfg->backend.data())) {
             /* this is an unrecoverable condition */
             return false;
         }
+        rec_add(REC_SRV_BOOT, lgn->uid, ~0UL, lgn->start_pid);
+        TRACE(boot, lgn->uid, -1, lgn->start_pid, -1);
         /* reset the buffer for next time */
         lgn->srvstr.clear();
     }
@@ -1168,6 +1506,7 @@ static bool fd_handle_conn(std::size_t i) {
     }
     if (fds[i].revents & POLLHUP) {
         print_dbg("conn: hup %d", fds[i].fd);
+        rec_add(REC_CONN_HUP, ~0U, ~0UL, -1, fds[i].fd);
         conn_term(fds[i].fd);
         fds[i].fd = -1;
         fds[i].revents = 0;
@@ -1177,6 +1516,7 @@ static bool fd_handle_conn(std::size_t i) {
         /* input on connection */
         try {
             print_dbg("conn: read %d", fds[i].fd);
+            rec_add(REC_CONN_READ, ~0U, ~0UL, -1, fds[i].fd);
             if (!handle_read(fds[i].fd)) {
                 goto read_fail;
             }
@@ -1186,6 +1526,8 @@ static bool fd_handle_conn(std::size_t i) {
     }
     return true;
 read_fail:
+    stats_count(STATS_ERRORS);
+    rec_add(REC_CONN_ERROR, ~0U, ~0UL, -1, fds[i].fd, errno);
     print_err("read: handler failed (terminate connection)");
     conn_term(fds[i].fd);
     fds[i].fd = -1;
@@ -1193,6 +1535,44 @@ read_fail:
     return true;
 }
 
+/* the memory is getting tight, so stop the service manager that has been
+ * idle the longest; while it lasts, the trigger keeps firing once every
+ * window, so they keep going one at a time, and interactive logins (which
+ * always have sessions) are never touched
+ */
+static void fd_handle_pressure() {
+    auto &pfd = fds[2];
+    if (!pfd.revents) {
+        return;
+    }
+    if (pfd.revents & (POLLERR | POLLNVAL)) {
+        print_err("pressure: trigger failed, no longer watching pressure");
+        close(pfd.fd);
+        pfd.fd = -1;
+        return;
+    }
+    login *idle = nullptr;
+    for (auto &lgn: logins) {
+        if (!lgn.sessions.empty() || (lgn.srv_pid == -1) || lgn.srv_wait) {
+            continue;
+        }
+        if (!idle || (lgn.t_idle < idle->t_idle)) {
+            idle = &lgn;
+        }
+    }
+    if (!idle) {
+        print_dbg("pressure: no idle service manager to stop");
+        return;
+    }
+    print_log(
+        LOG_INFO, "Memory pressure, stopping idle service manager of %s (%u)",
+        idle->username.data(), idle->uid
+    );
+    stats_count(STATS_EVICTIONS);
+    rec_add(REC_SRV_EVICT, idle->uid, ~0UL, idle->srv_pid);
+    login_stop(*idle);
+}
+
 static void sock_handle_conn() {
     if (!fds[1].revents) {
         return;
@@ -1213,9 +1593,340 @@ static void sock_handle_conn() {
         rfd.events = POLLIN | POLLHUP;
         rfd.revents = 0;
         print_dbg("conn: accepted %d for %d", afd, fds[1].fd);
+        rec_add(REC_CONN_ACCEPT, ~0U, ~0UL, -1, afd);
+        cap_add(CAP_ACCEPT, afd);
+        TRACE(accept, -1, -1, -1, afd);
+    }
+}
+
+/* all the signals that the daemon handles */
+static void sig_handled_set(sigset_t &mask) {
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGALRM);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGUSR2);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGIO);
+}
+
+/* all the descriptors that have to survive a re-exec */
+static void upgrade_fds(std::vector<int> &out) {
+    out.push_back(dirfd_base);
+    out.push_back(dirfd_users);
+    out.push_back(dirfd_sessions);
+    out.push_back(ctl_sock);
+    for (auto &lgn: logins) {
+        if (lgn.dirfd >= 0) {
+            out.push_back(lgn.dirfd);
+        }
+        if (lgn.userpipe >= 0) {
+            out.push_back(lgn.userpipe);
+        }
+    }
+    for (std::size_t i = npipes + nfixed; i < fds.size(); ++i) {
+        if (fds[i].fd >= 0) {
+            out.push_back(fds[i].fd);
+        }
     }
 }
 
+static bool upgrade_write(std::vector<timespec> const &left) {
+    if ((mkdir(cdata->state_path.data(), 0755) < 0) && (errno != EEXIST)) {
+        print_err("upgrade: failed to make state dir (%s)", strerror(errno));
+        return false;
+    }
+    auto *f = std::fopen(state_tmp.data(), "wb");
+    if (!f) {
+        print_err("upgrade: failed to open state (%s)", strerror(errno));
+        return false;
+    }
+    std::size_t nconns = 0, npend = pending_sess.size();
+    std::size_t nlogins = logins.size();
+    for (std::size_t i = npipes + nfixed; i < fds.size(); ++i) {
+        if (fds[i].fd >= 0) {
+            ++nconns;
+        }
+    }
+    bool ok = (
+        state_put(f, &upgrade_magic, sizeof(upgrade_magic)) &&
+        state_put(f, &upgrade_version, sizeof(upgrade_version)) &&
+        state_put(f, &idbase, sizeof(idbase)) &&
+        state_put(f, &dirfd_base, sizeof(dirfd_base)) &&
+        state_put(f, &dirfd_users, sizeof(dirfd_users)) &&
+        state_put(f, &dirfd_sessions, sizeof(dirfd_sessions)) &&
+        state_put(f, &ctl_sock, sizeof(ctl_sock)) &&
+        state_put(f, &nconns, sizeof(nconns))
+    );
+    for (std::size_t i = npipes + nfixed; ok && (i < fds.size()); ++i) {
+        if (fds[i].fd >= 0) {
+            ok = state_put(f, &fds[i].fd, sizeof(fds[i].fd));
+        }
+    }
+    ok = ok && state_put(f, &npend, sizeof(npend));
+    for (std::size_t i = 0; ok && (i < npend); ++i) {
+        ok = state_put(f, &pending_sess[i], sizeof(int));
+    }
+    ok = ok && state_put(f, &nlogins, sizeof(nlogins));
+    for (std::size_t i = 0; ok && (i < nlogins); ++i) {
+        ok = state_put_login(f, logins[i], left[i]);
+    }
+    /* so that anonymized captures stay consistent, added in version 3 */
+    std::uint64_t ckey;
+    bool chave = cap_get_key(ckey);
+    ok = ok && state_put(f, &chave, sizeof(chave)) &&
+        state_put(f, &ckey, sizeof(ckey));
+    /* the configurations in use, the current one first and then which
+     * one each login has, so that reloads are kept; added in version 5
+     */
+    std::vector<cfg_data const *> cfgs{cdata};
+    std::vector<std::uint32_t> cfgidx;
+    for (auto &lgn: logins) {
+        std::size_t idx = 0;
+        while ((idx < cfgs.size()) && (cfgs[idx] != lgn.cfg.get())) {
+            ++idx;
+        }
+        if (idx == cfgs.size()) {
+            cfgs.push_back(lgn.cfg.get());
+        }
+        cfgidx.push_back(std::uint32_t(idx));
+    }
+    std::size_t ncfgs = cfgs.size();
+    ok = ok && state_put(f, &ncfgs, sizeof(ncfgs));
+    for (std::size_t i = 0; ok && (i < ncfgs); ++i) {
+        ok = state_put_cfg(f, *cfgs[i]);
+    }
+    for (std::size_t i = 0; ok && (i < nlogins); ++i) {
+        ok = state_put(f, &cfgidx[i], sizeof(cfgidx[i]));
+    }
+    if ((std::fclose(f) != 0) || !ok) {
+        print_err("upgrade: failed to write state");
+        unlink(state_tmp.data());
+        return false;
+    }
+    if (rename(state_tmp.data(), state_file.data()) < 0) {
+        print_err("upgrade: failed to rename state (%s)", strerror(errno));
+        unlink(state_tmp.data());
+        return false;
+    }
+    return true;
+}
+
+/* re-execute the daemon, handing over all the state to the new image
+ *
+ * the service managers stay our children and all descriptors (control
+ * socket, connections, readiness pipes) are inherited, so nothing is
+ * visible from the outside; if anything fails, we just keep running
+ */
+static void sig_handle_upgrade() {
+    sigset_t mask, omask;
+    sig_handled_set(mask);
+    /* from here on signals stay pending, they are inherited across exec
+     * and get delivered once the new image is ready for them
+     */
+    sigprocmask(SIG_BLOCK, &mask, &omask);
+    /* signals that were already forwarded are handled first */
+    pollfd pfd;
+    pfd.fd = sigpipe[0];
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, 0) > 0) {
+        sigprocmask(SIG_SETMASK, &omask, nullptr);
+        return;
+    }
+    upgrade = false;
+    print_dbg("turnstiled: upgrade");
+    rec_add(REC_DAEMON_UPGRADE);
+    /* timers do not survive exec, so remember how much is left on them;
+     * an expired timer has nothing left and will fire right away
+     */
+    std::vector<timespec> left(logins.size());
+    for (std::size_t i = 0; i < logins.size(); ++i) {
+        auto &lgn = logins[i];
+        left[i] = timespec{};
+        if (!lgn.timer_armed) {
+            continue;
+        }
+        itimerspec tval;
+        if (timer_gettime(lgn.timer, &tval) == 0) {
+            left[i] = tval.it_value;
+        }
+        timer_delete(lgn.timer);
+    }
+    /* and drop any alarms they may have left behind, as those carry
+     * pointers that mean nothing to the new image
+     */
+    {
+        sigset_t amask;
+        sigemptyset(&amask);
+        sigaddset(&amask, SIGALRM);
+        timespec zero{};
+        while (sigtimedwait(&amask, nullptr, &zero) > 0) {}
+    }
+    std::vector<int> keep;
+    upgrade_fds(keep);
+    if (upgrade_write(left)) {
+        for (auto fd: keep) {
+            fcntl(fd, F_SETFD, 0);
+        }
+        setenv(UPGRADE_ENV, "1", 1);
+        /* the flusher does not survive the exec, so get it all out */
+        log_exit();
+        cap_close();
+        execv(exe_path.data(), main_argv);
+        log_init();
+        cap_open(cdata->capture_path.data(), cdata->capture_anon);
+        print_err("upgrade: exec failed (%s)", strerror(errno));
+        unsetenv(UPGRADE_ENV);
+        unlink(state_file.data());
+        for (auto fd: keep) {
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+    }
+    /* we keep going as we were */
+    for (std::size_t i = 0; i < logins.size(); ++i) {
+        auto &lgn = logins[i];
+        if (!lgn.timer_armed) {
+            continue;
+        }
+        lgn.timer_armed = false;
+        if (!left[i].tv_sec && !left[i].tv_nsec) {
+            left[i].tv_nsec = 1;
+        }
+        lgn.arm_timer(left[i].tv_sec, left[i].tv_nsec);
+    }
+    sigprocmask(SIG_SETMASK, &omask, nullptr);
+}
+
+/* pick up the state of the image we were executed from */
+static bool upgrade_restore(std::vector<int> &conns) {
+    auto *f = std::fopen(state_file.data(), "rb");
+    if (!f) {
+        print_err("upgrade: failed to open state (%s)", strerror(errno));
+        return false;
+    }
+    unlink(state_file.data());
+    std::uint32_t magic, version;
+    std::size_t nconns, npend, nlogins;
+    std::vector<timespec> left;
+    std::vector<std::shared_ptr<cfg_data const>> cfgs;
+    if (!(
+        state_get(f, &magic, sizeof(magic)) &&
+        state_get(f, &version, sizeof(version)) &&
+        (magic == upgrade_magic) && (version <= upgrade_version) &&
+        state_get(f, &idbase, sizeof(idbase)) &&
+        state_get(f, &dirfd_base, sizeof(dirfd_base)) &&
+        state_get(f, &dirfd_users, sizeof(dirfd_users)) &&
+        state_get(f, &dirfd_sessions, sizeof(dirfd_sessions)) &&
+        state_get(f, &ctl_sock, sizeof(ctl_sock)) &&
+        state_get(f, &nconns, sizeof(nconns)) && (nconns <= INT_MAX)
+    )) {
+        goto fail;
+    }
+    conns.resize(nconns);
+    for (auto &fd: conns) {
+        if (!state_get(f, &fd, sizeof(fd))) {
+            goto fail;
+        }
+    }
+    if (!state_get(f, &npend, sizeof(npend)) || (npend > nconns)) {
+        goto fail;
+    }
+    pending_sess.resize(npend);
+    for (auto &fd: pending_sess) {
+        if (!state_get(f, &fd, sizeof(fd))) {
+            goto fail;
+        }
+    }
+    if (!state_get(f, &nlogins, sizeof(nlogins)) || (nlogins > INT_MAX)) {
+        goto fail;
+    }
+    left.resize(nlogins);
+    for (std::size_t i = 0; i < nlogins; ++i) {
+        auto &lgn = logins.emplace_back();
+        if (!state_get_login(f, lgn, left[i], version)) {
+            goto fail;
+        }
+    }
+    if (version >= 3) {
+        std::uint64_t ckey;
+        bool chave;
+        if (
+            !state_get(f, &chave, sizeof(chave)) ||
+            !state_get(f, &ckey, sizeof(ckey))
+        ) {
+            goto fail;
+        }
+        if (chave) {
+            cap_set_key(ckey);
+        }
+    }
+    if (version >= 5) {
+        std::size_t ncfgs;
+        if (
+            !state_get(f, &ncfgs, sizeof(ncfgs)) || !ncfgs ||
+            (ncfgs > (nlogins + 1))
+        ) {
+            goto fail;
+        }
+        cfgs.resize(ncfgs);
+        for (auto &cfg: cfgs) {
+            auto ncfg = std::make_shared<cfg_data>();
+            if (!state_get_cfg(f, *ncfg)) {
+                goto fail;
+            }
+            cfg = std::move(ncfg);
+        }
+        for (auto &lgn: logins) {
+            std::uint32_t idx;
+            if (!state_get(f, &idx, sizeof(idx)) || (idx >= ncfgs)) {
+                goto fail;
+            }
+            lgn.cfg = cfgs[idx];
+        }
+        /* what was fixed at startup stays as the old image had it */
+        cfg_keep_fixed(*cfg_cur, *cfgs[0]);
+    }
+    std::fclose(f);
+    for (std::size_t i = 0; i < nlogins; ++i) {
+        auto &lgn = logins[i];
+        /* older images do not pass the configurations on */
+        if (!lgn.cfg) {
+            lgn.cfg = cfg_cur;
+        }
+        for (auto &sess: lgn.sessions) {
+            sess.lgn = &lgn;
+        }
+        if (left[i].tv_sec < 0) {
+            continue;
+        }
+        if (!left[i].tv_sec && !left[i].tv_nsec) {
+            left[i].tv_nsec = 1;
+        }
+        lgn.arm_timer(left[i].tv_sec, left[i].tv_nsec);
+    }
+    print_dbg(
+        "upgrade: restored %zu logins, %zu connections", nlogins, nconns
+    );
+    return true;
+fail:
+    print_err("upgrade: invalid state file");
+    std::fclose(f);
+    return false;
+}
+
+static void usage(FILE *f, char const *progname) {
+    std::fprintf(
+        f, "usage: %s [-c CONFIG] [-o NAME=VALUE]... [CONFIG]\n\n"
+        "  -c CONFIG      the configuration file (default %s)\n"
+        "  -o NAME=VALUE  a setting that overrides the configuration file\n"
+        "  -h             print this message\n",
+        progname, DEFAULT_CFG_PATH
+    );
+}
+
 int main(int argc, char **argv) {
     /* establish simple signal handler for sigchld */
     {
@@ -1226,6 +1937,10 @@ int main(int argc, char **argv) {
         sigaction(SIGCHLD, &sa, nullptr);
         sigaction(SIGTERM, &sa, nullptr);
         sigaction(SIGINT, &sa, nullptr);
+        sigaction(SIGUSR1, &sa, nullptr);
+        sigaction(SIGUSR2, &sa, nullptr);
+        sigaction(SIGHUP, &sa, nullptr);
+        sigaction(SIGIO, &sa, nullptr);
     }
     /* establish more complicated signal handler for timers */
     {
@@ -1236,43 +1951,105 @@ int main(int argc, char **argv) {
         sigaction(SIGALRM, &sa, nullptr);
     }
 
+    for (int c; (c = getopt(argc, argv, "c:o:h")) > 0;) {
+        switch (c) {
+            case 'c':
+                cfg_path = optarg;
+                break;
+            case 'o':
+                if (!std::strchr(optarg, '=') || (optarg[0] == '=')) {
+                    usage(stderr, argv[0]);
+                    return 1;
+                }
+                cfg_overrides.push_back(optarg);
+                break;
+            case 'h':
+                usage(stdout, argv[0]);
+                return 0;
+            default:
+                usage(stderr, argv[0]);
+                return 1;
+        }
+    }
+    /* the configuration file may also be given as the only argument */
+    if (optind < argc) {
+        if ((optind + 1) < argc) {
+            usage(stderr, argv[0]);
+            return 1;
+        }
+        cfg_path = argv[optind];
+    }
+
+    main_argv = argv;
+    /* the path the running binary was loaded from, so that an upgrade
+     * picks up whatever has been installed in its place
+     */
+    char exe[PATH_MAX];
+    auto exelen = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+    if (exelen > 0) {
+        exe_path.assign(exe, std::size_t(exelen));
+    } else if (std::strchr(argv[0], '/')) {
+        exe_path = argv[0];
+    } else {
+        exe_path = DAEMON_PATH;
+    }
+    jitter_rng.seed(std::uint_fast32_t(getpid() ^ time(nullptr)));
+
     /* prealloc a bunch of space */
-    logins.reserve(16);
     fds.reserve(64);
     pending_sess.reserve(16);
 
     openlog("turnstiled", LOG_CONS | LOG_NDELAY, LOG_DAEMON);
 
-    syslog(LOG_INFO, "Initializing turnstiled...");
+    /* not fatal, messages are written synchronously without it */
+    log_init();
+
+    print_log(LOG_INFO, "Initializing turnstiled...");
 
     /* initialize configuration structure */
-    cfg_data cdata_val;
-    cdata = &cdata_val;
+    cfg_cur = std::make_shared<cfg_data>();
+    cfg_read(cfg_path, *cfg_cur);
+    if (!cfg_override(*cfg_cur)) {
+        return 1;
+    }
+    cfg_finalize(*cfg_cur);
+    cdata = cfg_cur.get();
 
-    if (argc >= 2) {
-        cfg_read(argv[1]);
-    } else {
-        cfg_read(DEFAULT_CFG_PATH);
+    base_dir = cdata->base_path + "/" SOCK_DIR;
+    state_file = cdata->state_path + "/" UPGRADE_STATE;
+    state_tmp = state_file + ".tmp";
+
+    if (cdata->unprivileged) {
+        print_log(LOG_INFO, "Running unprivileged");
     }
 
-    if (!cdata->manage_rdir && !std::getenv(
-        "TURNSTILED_LINGER_ENABLE_FORCE"
-    )) {
-        /* we don't want to linger when we are not in charge of the rundir,
-         * because services may be relying on it; we can never really delete
-         * the rundir when lingering, and something like elogind might
-         *
-         * for those who are aware of the consequences and have things handled
-         * on their own, they can start the daemon with the env variable
-         */
-        cdata->linger_never = true;
+    /* whether we are the new image of a daemon that is being upgraded */
+    bool restore = !!std::getenv(UPGRADE_ENV);
+    /* connections handed over from the old image */
+    std::vector<int> restore_conns;
+
+    if (restore) {
+        unsetenv(UPGRADE_ENV);
+        print_dbg("turnstiled: restore state");
+        if (!upgrade_restore(restore_conns)) {
+            return 1;
+        }
+    } else {
+        /* stale state from an upgrade that never finished */
+        unlink(state_file.data());
     }
 
+    print_dbg("turnstiled: init cleanup helper");
+
+    /* not fatal, the cleanup is done synchronously without it */
+    dir_gc_init();
+
     print_dbg("turnstiled: init signal fd");
 
-    {
+    /* when restoring, the directories are inherited as they were */
+    if (!restore) {
         struct stat pstat;
-        int dfd = open(RUN_PATH, O_RDONLY | O_NOFOLLOW);
+        int dfd = open(cdata->base_path.data(), O_RDONLY | O_NOFOLLOW);
         /* ensure the base path exists and is a directory */
         if (fstat(dfd, &pstat) || !S_ISDIR(pstat.st_mode)) {
             print_err("turnstiled base path does not exist");
@@ -1296,6 +2073,17 @@ int main(int argc, char **argv) {
             return 1;
         }
         close(dfd);
+        /* whatever a previous instance moved aside and did not get to;
+         * the base directory was cleared as a whole already above
+         */
+        if (cdata->manage_rdir) {
+            auto rpath = cdata->rdir_path.substr(
+                0, cdata->rdir_path.rfind('/')
+            );
+            if (!rpath.empty() && (rpath.find('%') == std::string::npos)) {
+                dir_gc_sweep(rpath.data());
+            }
+        }
     }
     /* ensure it is not accessible by service manager child processes */
     if (
@@ -1333,7 +2121,12 @@ int main(int argc, char **argv) {
 
     /* main control socket */
     {
-        if (!sock_new(DAEMON_SOCK, ctl_sock, CSOCK_MODE)) {
+        auto sock_path = base_dir + "/control.sock";
+        if (!restore && !sock_new(sock_path.data(), ctl_sock, CSOCK_MODE)) {
+            return 1;
+        }
+        if (restore && (fcntl(ctl_sock, F_SETFD, FD_CLOEXEC) < 0)) {
+            print_err("fcntl failed (%s)", strerror(errno));
             return 1;
         }
         auto &pfd = fds.emplace_back();
@@ -1342,15 +2135,78 @@ int main(int argc, char **argv) {
         pfd.revents = 0;
     }
 
+    /* memory pressure trigger, set up along with the stats below */
+    {
+        auto &pfd = fds.emplace_back();
+        pfd.fd = -1;
+        pfd.events = POLLPRI;
+        pfd.revents = 0;
+    }
+
+    /* not fatal, the service managers just do not get cgroups; anything
+     * left over from before is killed, unless it is still ours
+     */
+    cg_init(cdata->cgroup_path.data(), !restore);
+
+    if (restore) {
+        /* readiness pipes go first, then the connections */
+        for (auto &lgn: logins) {
+            /* the watches went away with the old image; a cgroup that
+             * has emptied out meanwhile is not going to be notified about
+             */
+            if (
+                cg_make(lgn, false) &&
+                (lgn.srv_pid == -1) && (lgn.term_pid == -1)
+            ) {
+                cg_drop(lgn);
+            }
+            if (lgn.dirfd >= 0) {
+                fcntl(lgn.dirfd, F_SETFD, FD_CLOEXEC);
+            }
+            if (lgn.userpipe < 0) {
+                continue;
+            }
+            fcntl(lgn.userpipe, F_SETFD, FD_CLOEXEC);
+            auto &pfd = fds.emplace_back();
+            pfd.fd = lgn.userpipe;
+            pfd.events = POLLIN | POLLHUP;
+            pfd.revents = 0;
+            ++npipes;
+        }
+        for (auto fd: restore_conns) {
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+            auto &pfd = fds.emplace_back();
+            pfd.fd = fd;
+            pfd.events = POLLIN | POLLHUP;
+            pfd.revents = 0;
+        }
+        /* the old image left the signals blocked, anything that came in
+         * meanwhile is delivered now; children may have exited before
+         * the handover too, so check on them regardless
+         */
+        sigset_t mask;
+        sig_handled_set(mask);
+        sigprocmask(SIG_UNBLOCK, &mask, nullptr);
+        sig_handler(SIGCHLD);
+        print_log(LOG_INFO, "Upgrade complete");
+    }
+
+    stats_arm();
+    /* not fatal, there is just no eviction */
+    pressure_arm();
+
+    /* not fatal, there is just nothing captured */
+    cap_open(cdata->capture_path.data(), cdata->capture_anon);
+
     print_dbg("turnstiled: main loop");
 
     std::size_t i = 0, curpipes;
-    bool term = false;
 
     /* main loop */
     for (;;) {
         print_dbg("turnstiled: poll");
         auto pret = poll(fds.data(), fds.size(), -1);
+        rec_add(REC_POLL, ~0U, ~0UL, -1, pret, (pret < 0) ? errno : 0);
         if (pret < 0) {
             /* interrupted by signal */
             if (errno == EINTR) {
@@ -1370,24 +2226,51 @@ int main(int argc, char **argv) {
                 goto do_compact;
             }
             if (sd.sign == SIGALRM) {
+                rec_add(REC_SIG_ALRM);
                 if (!sig_handle_alrm(sd.datap)) {
                     return 1;
                 }
                 goto signal_done;
             }
+            if (sd.sign == SIGHUP) {
+                rec_add(REC_SIG_HUP);
+                sig_handle_reload();
+                goto signal_done;
+            }
+            if (sd.sign == SIGUSR1) {
+                rec_add(REC_SIG_USR1);
+                rec_dump(dirfd_base);
+                goto signal_done;
+            }
+            if (sd.sign == SIGIO) {
+                rec_add(REC_SIG_IO);
+                sig_handle_io();
+                goto signal_done;
+            }
+            if (sd.sign == SIGUSR2) {
+                rec_add(REC_SIG_USR2);
+                /* done once the signal pipe is drained */
+                upgrade = true;
+                goto signal_done;
+            }
             if ((sd.sign == SIGTERM) || (sd.sign == SIGINT)) {
-                if (!sig_handle_term()) {
+                rec_add(REC_SIG_TERM);
+                if (!term && !sig_handle_term()) {
                     return 1;
                 }
-                term = true;
                 goto signal_done;
             }
             /* this is a SIGCHLD */
+            rec_add(REC_SIG_CHLD);
             if (!sig_handle_chld()) {
                 return 1;
             }
         }
 signal_done:
+        if (upgrade && !term) {
+            /* only returns if the upgrade did not happen (yet) */
+            sig_handle_upgrade();
+        }
         print_dbg("turnstiled: check term");
         if (term) {
             /* check if there are any more live processes */
@@ -1400,7 +2283,12 @@ signal_done:
                 }
             }
             if (die_now) {
-                /* no more managed processes */
+                /* no more managed processes, and unless something is still
+                 * dying, no cgroups either
+                 */
+                for (auto &lgn: logins) {
+                    cg_drop(lgn);
+                }
                 return 0;
             }
             /* the only thing to handle when terminating is signal pipe */
@@ -1409,10 +2297,12 @@ signal_done:
         /* check incoming connections on control socket */
         print_dbg("turnstiled: check incoming");
         sock_handle_conn();
+        /* check on memory pressure */
+        fd_handle_pressure();
         /* check on pipes; npipes may be changed by fd_handle_pipe */
         curpipes = npipes;
         print_dbg("turnstiled: check pipes");
-        for (i = 2; i < (curpipes + 2); ++i) {
+        for (i = nfixed; i < (curpipes + nfixed); ++i) {
             try {
                 if (!fd_handle_pipe(i)) {
                     return 1;
@@ -1431,7 +2321,7 @@ signal_done:
 do_compact:
         print_dbg("turnstiled: compact");
         /* compact the descriptor list */
-        for (auto it = fds.begin(); it != fds.end();) {
+        for (auto it = fds.begin() + nfixed; it != fds.end();) {
             if (it->fd == -1) {
                 it = fds.erase(it);
             } else {
@@ -1448,7 +2338,7 @@ do_compact:
             pfd.events = POLLIN | POLLHUP;
             pfd.revents = 0;
             /* insert in the pipe area so they are polled before conns */
-            fds.insert(fds.begin() + 2, pfd);
+            fds.insert(fds.begin() + nfixed, pfd);
             /* ensure it's not re-queued again */
             lgn.pipe_queued = false;
             ++npipes;
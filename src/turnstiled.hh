@@ -8,18 +8,84 @@
 #define TURNSTILED_HH
 
 #include <cstddef>
+#include <cstdint>
 #include <cstdio>
 #include <ctime>
+#include <deque>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <utility>
 #include <vector>
 
 #include <signal.h>
 #include <syslog.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 
 #include "protocol.hh"
+#include "rec_events.hh"
+#include "cap_trace.hh"
 
 struct login;
+struct cfg_data;
+struct cfg_profile;
+
+/* an interned string; equal strings share one refcounted copy in a pool
+ * kept by the daemon, so the many sessions that mostly carry the same few
+ * values do not each have a copy of their own; empty strings are null
+ */
+struct istr {
+    struct entry {
+        std::size_t refs;
+        std::size_t len;
+        char str[1]; /* actually variable length */
+    };
+
+    istr() = default;
+    istr(istr const &o): ent{o.ent} {
+        if (ent) {
+            ++ent->refs;
+        }
+    }
+    istr(istr &&o) noexcept: ent{o.ent} {
+        o.ent = nullptr;
+    }
+    ~istr() {
+        reset();
+    }
+
+    istr &operator=(istr const &o) {
+        if (o.ent) {
+            ++o.ent->refs;
+        }
+        reset();
+        ent = o.ent;
+        return *this;
+    }
+    istr &operator=(istr &&o) noexcept {
+        if (this != &o) {
+            reset();
+            ent = o.ent;
+            o.ent = nullptr;
+        }
+        return *this;
+    }
+    istr &operator=(std::string_view str);
+
+    char const *data() const {
+        return ent ? ent->str : "";
+    }
+    std::size_t size() const {
+        return ent ? ent->len : 0;
+    }
+    bool empty() const {
+        return !ent;
+    }
+    void reset();
+
+    entry *ent = nullptr;
+};
 
 /* represents a single session within a login */
 struct session {
@@ -39,15 +105,17 @@ struct session {
         pend_rhost{1}
     {}
     /* data strings */
-    std::string s_service{};
-    std::string s_type{};
-    std::string s_class{};
-    std::string s_desktop{};
-    std::string s_seat{};
-    std::string s_tty{};
-    std::string s_display{};
-    std::string s_ruser{};
-    std::string s_rhost{};
+    istr s_service{};
+    istr s_type{};
+    istr s_class{};
+    istr s_desktop{};
+    istr s_seat{};
+    istr s_tty{};
+    istr s_display{};
+    istr s_ruser{};
+    istr s_rhost{};
+    /* a string that came in pieces, until it is complete */
+    std::string s_pend{};
     /* the login the session belongs to */
     login *lgn;
     /* session id */
@@ -56,6 +124,9 @@ struct session {
     unsigned long vtnr;
     /* pid of the login process */
     pid_t lpid;
+    /* when the session was set up, and when its handshake was done */
+    std::uint64_t t_begin = 0;
+    std::uint64_t t_handshake = 0;
     /* requested amount of data before we can proceed */
     int needed;
     /* whether we're remote */
@@ -92,12 +163,24 @@ struct login {
     std::string homedir{};
     /* the XDG_RUNTIME_DIR */
     std::string rundir{};
+    /* the configuration the login was set up with */
+    std::shared_ptr<cfg_data const> cfg{};
     /* the PID of the service manager process we are currently managing */
     pid_t srv_pid = -1;
     /* the PID of the backend "ready" process that reports final readiness */
     pid_t start_pid = -1;
     /* the PID of the service manager process that is currently dying */
     pid_t term_pid = -1;
+    /* start of the current restart window and restarts within it */
+    std::time_t restart_stamp = 0;
+    unsigned int restart_count = 0;
+    /* total number of service manager restarts */
+    unsigned int restart_total = 0;
+    /* when the service manager was forked and reported readiness */
+    std::uint64_t t_fork = 0;
+    std::uint64_t t_boot = 0;
+    /* when the last session of the login went away */
+    std::uint64_t t_idle = 0;
     /* login timer; there can be only one per login */
     timer_t timer{};
     sigevent timer_sev{};
@@ -110,12 +193,22 @@ struct login {
     int userpipe = -1;
     /* login directory descriptor */
     int dirfd = -1;
+    /* the watch on the login's cgroup, if it has one */
+    int cg_wd = -1;
     /* whether the login should be repopulated on next session */
     bool repopulate = true;
     /* true unless srv_pid has completely finished starting */
     bool srv_wait = true;
     /* false unless waiting for term_pid to quit before starting again */
     bool srv_pending = false;
+    /* whether a restart is scheduled on the timer after a crash */
+    bool srv_restart = false;
+    /* whether the service manager is to be frozen on the timer */
+    bool srv_freeze = false;
+    /* whether the cgroup of the service manager is frozen */
+    bool frozen = false;
+    /* whether the service manager kept crashing and was given up on */
+    bool srv_failed = false;
     /* whether to manage XDG_RUNTIME_DIR (typically false) */
     bool manage_rdir = false;
     /* whether the timer is actually currently set up */
@@ -127,28 +220,159 @@ struct login {
 
     login();
     void remove_sdir();
-    bool arm_timer(std::time_t);
+    bool arm_timer(std::time_t sec, long nsec = 0);
     void disarm_timer();
 };
 
 /* filesystem utilities */
 int dir_make_at(int dfd, char const *dname, mode_t mode);
-bool rundir_make(char *rundir, unsigned int uid, unsigned int gid);
+bool rundir_make(
+    char *rundir, unsigned int uid, unsigned int gid, cfg_data const &cfg
+);
 void rundir_clear(char const *rundir);
 bool dir_clear_contents(int dfd);
+void dir_remove_async(int pdfd, char const *ppath, char const *name);
+bool dir_gc_init();
+void dir_gc_sweep(char const *path);
+/* closes everything but the standard streams and the given descriptors */
+void fd_close_except(std::vector<int> keep);
+
+/* session and login utilities */
+session *get_session(std::deque<login> &logins, int fd);
+login *login_populate(
+    std::deque<login> &logins, std::shared_ptr<cfg_data> const &ncfg,
+    unsigned int uid
+);
+bool write_udata(login const &lgn, int dfd);
+bool write_sdata(session const &sess, int sdfd, int udfd);
+void drop_udata(login const &lgn, int dfd);
+void drop_sdata(session const &sess, int dfd);
+bool recv_val(int fd, void *buf, std::size_t sz);
+bool sess_handshake(session &sess);
+
+/* cgroup utilities; without cg_init, no login ever gets a cgroup */
+bool cg_init(char const *path, bool sweep);
+bool cg_make(login &lgn, bool create);
+/* what cg_enter needs, for children that close everything else */
+int cg_dirfd();
+bool cg_enter(login const &lgn);
+bool cg_kill(login const &lgn);
+bool cg_freeze(login const &lgn, bool freeze);
+bool cg_limit(login const &lgn, cfg_profile const *prof);
+bool cg_drop(login &lgn);
+bool cg_events(std::vector<int> &wds);
+
+/* pressure stall information */
+int psi_open(char const *path, unsigned long stall, unsigned long window);
 
 /* config file related utilities */
-void cfg_read(char const *cfgpath);
+bool cfg_read(char const *cfgpath, cfg_data &cfg);
+bool cfg_set(cfg_data &cfg, char const *name, char const *value, bool &valid);
 void cfg_expand_rundir(
     std::string &dest, char const *tmpl, unsigned int uid, unsigned int gid
 );
+bool cfg_parse_cpus(char const *str, std::vector<unsigned int> &cpus);
+cfg_profile const *cfg_find_profile(cfg_data const &cfg, login const &lgn);
 
 /* service manager utilities */
-void srv_child(login &sess, char const *backend, bool make_rundir);
+void srv_child(
+    login &sess, char const *backend, bool make_rundir, int readyfd,
+    cfg_profile const *prof
+);
 bool srv_boot(login &sess, char const *backend);
 
+/* statistics */
+enum stats_phase {
+    STATS_HANDSHAKE = 0, /* session setup to end of handshake */
+    STATS_PWD, /* looking up the user */
+    STATS_FORK, /* preparing and forking the service manager */
+    STATS_RUN, /* fork to readiness pipe */
+    STATS_READY, /* readiness pipe to the end of the ready job */
+    STATS_ENV, /* sending the environment */
+    STATS_LOGIN, /* session setup to the login being allowed to proceed */
+    STATS_PHASES,
+};
+
+enum stats_counter {
+    STATS_LOGINS = 0,
+    STATS_STARTS,
+    STATS_RESTARTS,
+    STATS_FAILURES,
+    STATS_TIMEOUTS,
+    STATS_KILLS,
+    STATS_ERRORS,
+    STATS_EVICTIONS,
+    STATS_COUNTERS,
+};
+
+std::uint64_t stats_now();
+void stats_record(stats_phase phase, std::uint64_t since);
+void stats_count(stats_counter counter);
+bool stats_write(int dfd);
+
+/* flight recorder; anything not applicable is left out or all ones */
+void rec_add(
+    rec_code code, unsigned int uid = ~0U, unsigned long sid = ~0UL,
+    long pid = -1, int fd = -1, int err = 0
+);
+bool rec_dump(int dfd);
+
+/* traffic capture, which records nothing unless a capture is open */
+bool cap_open(char const *path, bool anon);
+void cap_close();
+void cap_add(
+    cap_code code, int fd, void const *data = nullptr, std::size_t len = 0
+);
+void cap_handshake(session const &sess);
+bool cap_get_key(std::uint64_t &key);
+void cap_set_key(std::uint64_t key);
+
+/* upgrade state utilities */
+bool state_put(std::FILE *f, void const *buf, std::size_t len);
+bool state_get(std::FILE *f, void *buf, std::size_t len);
+bool state_put_login(std::FILE *f, login const &lgn, timespec const &left);
+bool state_get_login(
+    std::FILE *f, login &lgn, timespec &left, unsigned int version
+);
+bool state_put_cfg(std::FILE *f, cfg_data const &cfg);
+bool state_get_cfg(std::FILE *f, cfg_data &cfg);
+
+/* resource settings for a service manager, anything not set is left as is
+ * (or at the default for the cgroup values)
+ */
+struct cfg_profile {
+    struct limit {
+        int resource;
+        rlim_t cur;
+        rlim_t max;
+    };
+    std::string name{};
+    std::vector<limit> rlimits{};
+    std::vector<unsigned int> cpus{};
+    /* already in bytes */
+    std::string memory_high{};
+    long cpu_weight = -1;
+    long numa_node = -1;
+    /* the scheduling policy and the encoded I/O priority */
+    int sched = -1;
+    int ioprio = -1;
+    int nice = 0;
+    bool set_nice = false;
+};
+
+/* anything added here has to go into the upgrade state too, see the
+ * list in state_utils.cc
+ */
 struct cfg_data {
     time_t login_timeout = 60;
+    time_t shutdown_timeout = 60;
+    time_t restart_limit = 5;
+    time_t restart_interval = 60;
+    time_t stats_interval = 10;
+    time_t freeze_timeout = 0;
+    time_t pressure_stall = 150;
+    time_t pressure_window = 2000;
+    unsigned long rundir_inodes = 0;
     bool debug = false;
     bool disable = false;
     bool debug_stderr = false;
@@ -157,34 +381,70 @@ struct cfg_data {
     bool linger = false;
     bool linger_never = false;
     bool root_session = false;
+    bool ready_fd = false;
+    bool unprivileged = false;
+    bool capture_anon = true;
     std::string backend = "dinit";
     std::string rdir_path = RUN_PATH "/user/%u";
+    std::string rdir_size{};
+    std::string capture_path{};
+    std::string pressure_path{};
+    /* resource profiles and which users and session classes get them */
+    std::vector<cfg_profile> profiles{};
+    std::vector<std::pair<std::string, std::string>> profile_users{};
+    std::vector<std::pair<std::string, std::string>> profile_classes{};
+    /* locations; these and unprivileged only take effect at startup */
+    std::string cgroup_path{};
+    std::string base_path = RUN_PATH;
+    std::string linger_path = LINGER_PATH;
+    std::string state_path = STATE_PATH;
+    std::string backend_path = LIBEXEC_PATH;
+    std::string backend_conf_path = CONF_PATH "/backend";
 };
 
+/* the current configuration, used for new logins and the daemon itself */
 extern cfg_data *cdata;
 
-/* these are macros for a simple reason; making them functions will trigger
- * format-security warnings (even though it's technically always safe for
- * us, there is no way to bypass that portably) and making it a C-style
- * vararg function is not possible (because vsyslog is not standard)
- *
- * in a macro we just pass things through, so it's completely safe
+/* logging; messages less important than LOG_MIN_LEVEL are compiled out,
+ * the rest is queued and written out by a separate thread once running
+ */
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_DEBUG
+#endif
+
+bool log_init();
+void log_exit();
+void log_msg(int prio, char const *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/* these are macros so that the level checks are done before any of the
+ * arguments are evaluated, and the disabled levels are gone entirely
  */
 
+#define print_log(prio, ...) \
+    if ((prio) <= LOG_MIN_LEVEL) { \
+        log_msg(prio, __VA_ARGS__); \
+    }
+
 #define print_dbg(...) \
-    if (cdata->debug) { \
-        if (cdata->debug_stderr) { \
-            fprintf(stderr, __VA_ARGS__); \
-            fputc('\n', stderr); \
-        } \
-        syslog(LOG_DEBUG, __VA_ARGS__); \
+    if ((LOG_DEBUG <= LOG_MIN_LEVEL) && cdata->debug) { \
+        log_msg(LOG_DEBUG, __VA_ARGS__); \
     }
 
-#define print_err(...) \
-    if (cdata->debug_stderr) { \
-        fprintf(stderr, __VA_ARGS__); \
-        fputc('\n', stderr); \
-    } \
-    syslog(LOG_ERR, __VA_ARGS__);
+#define print_err(...) print_log(LOG_ERR, __VA_ARGS__)
+
+/* static tracepoints for tools like bpftrace, which are nops unless
+ * something attaches to them; every probe carries the uid, session id,
+ * a pid and a file descriptor, any of which are -1 when not applicable
+ */
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+#define TRACE(name, uid, sid, pid, fd) \
+    DTRACE_PROBE4( \
+        turnstiled, name, (long)(uid), (long)(sid), (long)(pid), (int)(fd) \
+    )
+#else
+#define TRACE(name, uid, sid, pid, fd)
+#endif
 
 #endif
@@ -0,0 +1,183 @@
+/* turnstiled-events: decode the event recorder of turnstiled
+ *
+ * the daemon writes its recorder into the socket directory when it gets
+ * SIGUSR1 or is asked to over the control socket; this prints the dump
+ * in a human readable form, one event per line
+ *
+ * Copyright 2022 q66 <q66@chimera-linux.org>
+ * License: BSD-2-Clause
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <string>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "protocol.hh"
+#include "rec_events.hh"
+
+static char const *rec_names[REC_CODES] = {
+#define REC_NAME(code, name) name,
+    REC_EVENTS(REC_NAME)
+#undef REC_NAME
+};
+
+static void usage(FILE *f, char const *progname) {
+    std::fprintf(
+        f, "usage: %s [-d] [-b PATH] [file]\n\n"
+        "  -d       ask the daemon to write a new dump first\n"
+        "  -b PATH  the base path of the daemon (default %s)\n"
+        "  -h       print this message\n\n"
+        "The default file is 'events' in the socket directory.\n",
+        progname, RUN_PATH
+    );
+}
+
+/* ask the daemon to dump the recorder and wait until it has */
+static bool request_dump(std::string const &spath) {
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        std::fprintf(stderr, "socket failed (%s)\n", strerror(errno));
+        return false;
+    }
+    sockaddr_un saddr;
+    std::memset(&saddr, 0, sizeof(saddr));
+    if (spath.size() >= sizeof(saddr.sun_path)) {
+        std::fprintf(stderr, "socket path %s too long\n", spath.data());
+        close(sock);
+        return false;
+    }
+    saddr.sun_family = AF_UNIX;
+    std::memcpy(saddr.sun_path, spath.data(), spath.size() + 1);
+    if (connect(
+        sock, reinterpret_cast<sockaddr const *>(&saddr), sizeof(saddr)
+    ) < 0) {
+        std::fprintf(
+            stderr, "could not connect to %s (%s)\n",
+            spath.data(), strerror(errno)
+        );
+        close(sock);
+        return false;
+    }
+    unsigned char msg = MSG_REC_DUMP;
+    ssize_t ret;
+    while ((ret = write(sock, &msg, sizeof(msg))) < 0) {
+        if (errno != EINTR) {
+            break;
+        }
+    }
+    if (ret == sizeof(msg)) {
+        while ((ret = read(sock, &msg, sizeof(msg))) < 0) {
+            if (errno != EINTR) {
+                break;
+            }
+        }
+    }
+    close(sock);
+    if ((ret != sizeof(msg)) || (msg != MSG_OK_DONE)) {
+        std::fprintf(stderr, "the daemon did not write a dump\n");
+        return false;
+    }
+    return true;
+}
+
+static void print_entry(rec_entry const &ent, std::int64_t realtime) {
+    auto ns = std::int64_t(ent.time) + realtime;
+    std::time_t secs = ns / 1000000000;
+    char tbuf[32];
+    tm tmv;
+    if (!localtime_r(&secs, &tmv) || !std::strftime(
+        tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S", &tmv
+    )) {
+        std::snprintf(tbuf, sizeof(tbuf), "%lld", (long long)secs);
+    }
+    std::printf("%s.%09lld ", tbuf, (long long)(ns % 1000000000));
+    if (ent.code < REC_CODES) {
+        std::printf("%s", rec_names[ent.code]);
+    } else {
+        std::printf("unknown(%u)", (unsigned int)ent.code);
+    }
+    if (ent.uid != ~std::uint32_t(0)) {
+        std::printf(" uid=%u", (unsigned int)ent.uid);
+    }
+    if (ent.sid != ~std::uint64_t(0)) {
+        std::printf(" sid=%llu", (unsigned long long)ent.sid);
+    }
+    if (ent.pid != -1) {
+        std::printf(" pid=%d", (int)ent.pid);
+    }
+    if (ent.fd != -1) {
+        std::printf(" fd=%d", (int)ent.fd);
+    }
+    if (ent.err) {
+        std::printf(" err=%s", strerror(ent.err));
+    }
+    std::putchar('\n');
+}
+
+int main(int argc, char **argv) {
+    bool dump = false;
+    char const *base = RUN_PATH;
+    int c;
+    while ((c = getopt(argc, argv, "db:h")) > 0) {
+        switch (c) {
+            case 'd':
+                dump = true;
+                break;
+            case 'b':
+                base = optarg;
+                break;
+            case 'h':
+                usage(stdout, argv[0]);
+                return 0;
+            default:
+                usage(stderr, argv[0]);
+                return 1;
+        }
+    }
+    if (argc > (optind + 1)) {
+        usage(stderr, argv[0]);
+        return 1;
+    }
+    auto sdir = std::string{base} + "/" SOCK_DIR;
+    auto epath = sdir + "/events";
+    char const *path = (optind < argc) ? argv[optind] : epath.data();
+    if (dump && !request_dump(sdir + "/control.sock")) {
+        return 1;
+    }
+    auto *f = std::fopen(path, "rb");
+    if (!f) {
+        std::fprintf(stderr, "could not open %s (%s)\n", path, strerror(errno));
+        return 1;
+    }
+    rec_header hdr;
+    if (
+        (std::fread(&hdr, sizeof(hdr), 1, f) != 1) ||
+        (hdr.magic != REC_MAGIC) || (hdr.version > REC_VERSION) ||
+        (hdr.rsize != sizeof(rec_entry))
+    ) {
+        std::fprintf(stderr, "%s is not a valid event dump\n", path);
+        std::fclose(f);
+        return 1;
+    }
+    if (hdr.lost) {
+        std::printf("(%u earlier events were lost)\n", (unsigned int)hdr.lost);
+    }
+    for (std::uint32_t i = 0; i < hdr.count; ++i) {
+        rec_entry ent;
+        if (std::fread(&ent, sizeof(ent), 1, f) != 1) {
+            std::fprintf(stderr, "%s is truncated\n", path);
+            std::fclose(f);
+            return 1;
+        }
+        print_entry(ent, hdr.realtime);
+    }
+    std::fclose(f);
+    return 0;
+}